@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <new>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "arena.h"
+
+using namespace std;
+
+
+static const size_t HUGEPAGE = 2 << 20;
+static const size_t CACHELINE = 64;
+
+static bool useHugePages = true;
+
+
+static size_t alignUp(size_t n, size_t align)
+{
+    return (n + align-1) & ~(align-1);
+}
+
+
+// How much of the mapping starting at 'base' the kernel has backed with
+// transparent huge pages, from /proc/self/smaps
+static size_t hugePageBytes(void *base)
+{
+    FILE *fp = fopen("/proc/self/smaps", "r");
+    if (!fp)
+        return 0;
+
+    char line[256];
+    bool found = false;
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long start, end;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            if (found)
+                break;
+            found = (start == (unsigned long)base);
+        } else if (found && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+    return found? kb*1024: 0;
+}
+
+
+void TableArena::setHugePages(bool enable)
+{
+    useHugePages = enable;
+}
+
+
+TableArena::TableArena()
+    : _base(0),
+      _size(0),
+      _huge(false),
+      _node(currentNode())
+{
+    size_t effortsize = alignUp(sizeof(double[NUMKEYS][NUMKEYS][KEYSTRIDE]), CACHELINE);
+    size_t digraphsize = alignUp(sizeof(int[0x7F][0x80]), CACHELINE);
+    _size = alignUp(effortsize + digraphsize, useHugePages? HUGEPAGE: CACHELINE);
+
+    // map a huge page more than needed, and trim it so the arena starts on
+    // a huge page boundary
+    size_t extra = useHugePages? HUGEPAGE: 0;
+    char *p = (char *)mmap(0, _size + extra, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        throw bad_alloc();
+    }
+
+    char *base = (char *)alignUp((size_t)p, useHugePages? HUGEPAGE: 1);
+    if (base > p)
+        munmap(p, base-p);
+    if (p+_size+extra > base+_size)
+        munmap(base+_size, p+_size+extra - (base+_size));
+    _base = base;
+
+#ifdef MADV_HUGEPAGE
+    if (useHugePages)
+        madvise(_base, _size, MADV_HUGEPAGE);
+#endif
+
+    // Whether huge pages were asked for or not says little about what the
+    // kernel did: madvise() succeeds even with THP set to never, and with
+    // it set to always they are used unasked.  So touch the arena and look.
+    memset(_base, 0, _size);
+    _huge = hugePageBytes(_base) > 0;
+
+    _effort = (double (*)[NUMKEYS][KEYSTRIDE])base;
+    _digraphs = (int (*)[0x80])(base + effortsize);
+}
+
+
+TableArena::~TableArena()
+{
+    map<int, TableArena *>::iterator it;
+    for (it = _replicas.begin(); it != _replicas.end(); it++)
+        delete it->second;
+    munmap(_base, _size);
+}
+
+
+// The tables must not change once a replica has been made.  The calling
+// thread should be pinned (pinThread), or it may move to another node.
+TableArena *TableArena::local()
+{
+    int node = currentNode();
+    if (node == _node)
+        return this;
+
+    lock_guard<mutex> guard(_lock);
+    TableArena *&replica = _replicas[node];
+    if (!replica) {
+        // the new arena's pages are first written by this thread, so the
+        // kernel puts them on its node
+        replica = new TableArena();
+        memcpy(replica->_base, _base, _size);
+    }
+    return replica;
+}
+
+
+// Pin the calling thread to the n'th cpu it may run on (modulo their number)
+bool pinThread(int n)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0)
+        return false;
+
+    n %= CPU_COUNT(&allowed);
+    for (int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || n-- > 0)
+            continue;
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        return sched_setaffinity(0, sizeof(one), &one) == 0;
+    }
+    return false;
+}
+
+
+int currentNode()
+{
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, 0) != 0)
+        return 0;
+    return node;
+}
+
+
+
+TlbCounter::TlbCounter()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1;
+
+    // every thread of this process, on any cpu
+    _fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+TlbCounter::~TlbCounter()
+{
+    if (_fd >= 0)
+        close(_fd);
+}
+
+
+void TlbCounter::start()
+{
+    if (_fd < 0)
+        return;
+    ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+
+uint64_t TlbCounter::stop()
+{
+    uint64_t count = 0;
+    if (_fd < 0)
+        return 0;
+    ioctl(_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(_fd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+    return count;
+}
@@ -0,0 +1,82 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include "configuration.h"
+
+
+/* One block of memory holding the tables that are read (but not changed)
+   while optimizing: the triad effort table and the digraph counts.
+
+   The block is aligned to a huge page, and the kernel is asked to back it
+   with transparent huge pages, so the tables take one or two TLB entries
+   rather than a few hundred.  Each table starts on a cache line, and its
+   innermost dimension is padded (KEYSTRIDE, 0x80) to whole cache lines.
+
+   local() gives a copy of the tables on the NUMA node of the calling
+   thread, made on first use by that thread so the kernel places its pages
+   there.  The thread must be pinned to a cpu (pinThread) for that node to
+   stay its own.  On a single node host it is the arena itself. */
+class TableArena
+{
+public:
+    TableArena();
+    ~TableArena();
+
+    // Whether new arenas ask for huge pages (they do by default)
+    static void setHugePages(bool enable);
+
+    double (*effort())[NUMKEYS][KEYSTRIDE] { return _effort; }
+    int (*digraphs())[0x80] { return _digraphs; }
+
+    // whether the kernel really backed the arena with huge pages
+    bool hugePages() const { return _huge; }
+    int node() const { return _node; }
+
+    TableArena *local();
+
+private:
+    TableArena(const TableArena &);
+    void operator=(const TableArena &);
+
+private:
+    void *_base;
+    size_t _size;
+    bool _huge;
+    int _node;
+
+    double (*_effort)[NUMKEYS][KEYSTRIDE];
+    int (*_digraphs)[0x80];
+
+    std::mutex _lock;
+    std::map<int, TableArena *> _replicas;
+};
+
+
+// Keep the calling thread on one cpu: the n'th of those it may use
+bool pinThread(int n);
+
+// NUMA node of the cpu the calling thread is running on
+int currentNode();
+
+
+/* Counts the data TLB misses of this process through perf_event_open(),
+   where the kernel allows it. */
+class TlbCounter
+{
+public:
+    TlbCounter();
+    ~TlbCounter();
+
+    bool available() const { return _fd >= 0; }
+    void start();
+    uint64_t stop();
+
+private:
+    int _fd;
+};
+
+
+#endif
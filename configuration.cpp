@@ -10,6 +10,7 @@ using namespace std;
 Configuration::Configuration()
 {
     load("conf/base_effort.conf");
+    loadConstraints("conf/constraints.conf");
 }
 
 // read/parse configuration file(s) into into memory
@@ -45,3 +46,47 @@ bool Configuration::load(const std::string &base_config_file)
 
     return true;
 }
+
+
+// read the key movement constraints.  Each line is a keyword and a list of keys:
+//   pin  <keys>   keys that are never moved
+//   hand <keys>   keys that may only move within the hand they start on
+//   pair <ab>     two keys that must stay side by side, 'a' left of 'b'
+bool Configuration::loadConstraints(const std::string &constraints_file)
+{
+    _pinned.clear();
+    _onehand.clear();
+    _pairs.clear();
+
+    FILE *fp = fopen(constraints_file.c_str(), "r");
+    if (!fp) {
+        return false;
+    }
+
+    bool ok = true;
+    vector<string> tokens;
+    char buf[4096];
+    while (fgets(buf, sizeof(buf)-1, fp)) {
+        string line = util::trim(buf); 
+        // skip comment lines
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        tokens = util::split(line);
+        for (size_t i=1; i<tokens.size(); i++) {
+            if (tokens[0] == "pin") {
+                _pinned += tokens[i];
+            } else if (tokens[0] == "hand") {
+                _onehand += tokens[i];
+            } else if (tokens[0] == "pair" && tokens[i].length() == 2) {
+                _pairs.push_back(tokens[i]);
+            } else {
+                printf("Warning, ignoring constraint '%s %s'\n", tokens[0].c_str(), tokens[i].c_str());
+                ok = false;
+            }
+        }
+    }
+
+    fclose(fp);
+    return ok;
+}
@@ -7,6 +7,9 @@
 
 #define NUMKEYS 47
 
+// row length of the effort table, padded so rows are whole cache lines
+#define KEYSTRIDE 48
+
 
 class Configuration
 {
@@ -14,10 +17,19 @@ public:
     Configuration();
 
     bool load(const std::string &base_effort_file);
+    bool loadConstraints(const std::string &constraints_file);
     double baseEffort(int keyindex) { return _base_effort[keyindex]; }
 
+    const std::string &pinnedKeys() const { return _pinned; }
+    const std::string &oneHandKeys() const { return _onehand; }
+    const std::vector<std::string> &keyPairs() const { return _pairs; }
+
 private:
     std::vector<double> _base_effort;  // indexed by key index
+
+    std::string _pinned;               // keys that never move
+    std::string _onehand;              // keys that stay on the hand they start on
+    std::vector<std::string> _pairs;   // 2-key groups that stay side by side
 };
 
 
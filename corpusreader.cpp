@@ -0,0 +1,315 @@
+#include <string.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "corpusreader.h"
+
+using namespace std;
+
+
+CorpusReader::CorpusReader(size_t bufsize, size_t depth)
+    : _fp(0),
+      _format(CorpusPlain),
+      _bufsize(bufsize),
+      _depth(depth),
+      _done(true),
+      _stopping(false),
+      _failed(false)
+{
+}
+
+
+CorpusReader::~CorpusReader()
+{
+    close();
+
+    for (size_t i=0; i<_free.size(); i++)
+        delete _free[i];
+}
+
+
+// Identify the container format from the first bytes of a file
+CorpusFormat CorpusReader::detectFormat(const uint8_t *magic, size_t len)
+{
+    if (len >= 2 && magic[0] == 0x1F && magic[1] == 0x8B)
+        return CorpusGzip;
+    if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD)
+        return CorpusZstd;
+    return CorpusPlain;
+}
+
+
+// Open 'file' and start the decoder thread
+bool CorpusReader::open(const string &file)
+{
+    close();
+
+    _fp = fopen(file.c_str(), "rb");
+    if (!_fp)
+        return false;
+
+    uint8_t magic[4];
+    size_t n = fread(magic, 1, sizeof(magic), _fp);
+    _format = detectFormat(magic, n);
+    rewind(_fp);
+
+#ifndef HAVE_ZSTD
+    if (_format == CorpusZstd) {
+        fprintf(stderr, "'%s' is zstd compressed, but zstd support was not built in (make ZSTD=1)\n", file.c_str());
+        fclose(_fp);
+        _fp = 0;
+        return false;
+    }
+#endif
+
+    _done = false;
+    _stopping = false;
+    _failed = false;
+    _decoder = thread(&CorpusReader::decode, this);
+    return true;
+}
+
+
+// Stop the decoder (if still running) and release the file
+void CorpusReader::close()
+{
+    if (_decoder.joinable()) {
+        {
+            lock_guard<mutex> guard(_lock);
+            _stopping = true;
+        }
+        _drained.notify_all();
+        _decoder.join();
+    }
+
+    while (!_queue.empty()) {
+        _free.push_back(_queue.front());
+        _queue.pop_front();
+    }
+
+    if (_fp) {
+        fclose(_fp);
+        _fp = 0;
+    }
+    _done = true;
+}
+
+
+bool CorpusReader::next(vector<char> &buf)
+{
+    unique_lock<mutex> guard(_lock);
+    while (_queue.empty() && !_done)
+        _filled.wait(guard);
+
+    if (_queue.empty())
+        return false;
+
+    vector<char> *chunk = _queue.front();
+    _queue.pop_front();
+    buf.swap(*chunk);
+    _free.push_back(chunk);
+    guard.unlock();
+
+    _drained.notify_one();
+    return true;
+}
+
+
+// Take an empty buffer, blocking while the queue is full
+vector<char> *CorpusReader::acquireBuffer()
+{
+    unique_lock<mutex> guard(_lock);
+    while (_queue.size() >= _depth && !_stopping)
+        _drained.wait(guard);
+
+    if (_stopping)
+        return 0;
+
+    vector<char> *buf;
+    if (_free.empty()) {
+        buf = new vector<char>;
+    } else {
+        buf = _free.back();
+        _free.pop_back();
+    }
+    buf->resize(_bufsize);
+    return buf;
+}
+
+
+// Hand a filled buffer to the consumer.  Returns false if the consumer quit.
+bool CorpusReader::pushBuffer(vector<char> *buf)
+{
+    {
+        lock_guard<mutex> guard(_lock);
+        if (_stopping) {
+            _free.push_back(buf);
+            return false;
+        }
+        _queue.push_back(buf);
+    }
+    _filled.notify_one();
+    return true;
+}
+
+
+// decoder thread entry point
+void CorpusReader::decode()
+{
+    bool ok = false;
+    switch (_format) {
+    case CorpusPlain: ok = decodePlain(); break;
+    case CorpusGzip:  ok = decodeGzip();  break;
+    case CorpusZstd:  ok = decodeZstd();  break;
+    }
+
+    {
+        lock_guard<mutex> guard(_lock);
+        _failed = !ok;
+        _done = true;
+    }
+    _filled.notify_all();
+}
+
+
+bool CorpusReader::decodePlain()
+{
+    vector<char> *buf;
+    while ((buf = acquireBuffer())) {
+        size_t n = fread(&(*buf)[0], 1, _bufsize, _fp);
+        if (n == 0) {
+            lock_guard<mutex> guard(_lock);
+            _free.push_back(buf);
+            return !ferror(_fp);
+        }
+        buf->resize(n);
+        if (!pushBuffer(buf))
+            break;
+    }
+    return true;
+}
+
+
+bool CorpusReader::decodeGzip()
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 15+32: accept a zlib or gzip header, with the maximum window
+    if (inflateInit2(&zs, 15+32) != Z_OK)
+        return false;
+
+    vector<unsigned char> in(_bufsize);
+    bool ok = true;
+    bool eof = false;
+    bool ended = false;   // the last member was complete
+    vector<char> *buf;
+
+    while (ok && (buf = acquireBuffer())) {
+        zs.next_out = (Bytef *)&(*buf)[0];
+        zs.avail_out = _bufsize;
+
+        while (zs.avail_out > 0) {
+            if (zs.avail_in == 0) {
+                if (eof)
+                    break;
+                zs.avail_in = fread(&in[0], 1, in.size(), _fp);
+                zs.next_in = &in[0];
+                if (zs.avail_in == 0) {
+                    eof = true;
+                    ok = !ferror(_fp);
+                    if (ok && !ended) {
+                        fprintf(stderr, "Corpus ends in the middle of a gzip stream\n");
+                        ok = false;
+                    }
+                    break;
+                }
+            }
+
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            ended = (ret == Z_STREAM_END);
+            if (ret == Z_STREAM_END) {
+                // gzip files may hold several concatenated members
+                inflateReset(&zs);
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                ok = false;
+                break;
+            }
+        }
+
+        size_t n = _bufsize - zs.avail_out;
+        if (n == 0) {
+            lock_guard<mutex> guard(_lock);
+            _free.push_back(buf);
+            break;
+        }
+        buf->resize(n);
+        if (!pushBuffer(buf))
+            break;
+    }
+
+    inflateEnd(&zs);
+    return ok;
+}
+
+
+bool CorpusReader::decodeZstd()
+{
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zs = ZSTD_createDStream();
+    if (!zs)
+        return false;
+    ZSTD_initDStream(zs);
+
+    vector<char> in(ZSTD_DStreamInSize());
+    ZSTD_inBuffer input = { &in[0], 0, 0 };
+    bool ok = true;
+    bool eof = false;
+    bool ended = false;   // the last frame was complete
+    vector<char> *buf;
+
+    while (ok && (buf = acquireBuffer())) {
+        ZSTD_outBuffer output = { &(*buf)[0], _bufsize, 0 };
+
+        while (output.pos < output.size) {
+            if (input.pos == input.size) {
+                if (eof)
+                    break;
+                input.size = fread(&in[0], 1, in.size(), _fp);
+                input.pos = 0;
+                if (input.size == 0) {
+                    eof = true;
+                    ok = !ferror(_fp);
+                    if (ok && !ended) {
+                        fprintf(stderr, "Corpus ends in the middle of a zstd frame\n");
+                        ok = false;
+                    }
+                    break;
+                }
+            }
+
+            // 0 once a frame is completely decoded and flushed
+            size_t ret = ZSTD_decompressStream(zs, &output, &input);
+            ended = (ret == 0);
+            if (ZSTD_isError(ret)) {
+                ok = false;
+                break;
+            }
+        }
+
+        if (output.pos == 0) {
+            lock_guard<mutex> guard(_lock);
+            _free.push_back(buf);
+            break;
+        }
+        buf->resize(output.pos);
+        if (!pushBuffer(buf))
+            break;
+    }
+
+    ZSTD_freeDStream(zs);
+    return ok;
+#else
+    return false;
+#endif
+}
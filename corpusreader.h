@@ -0,0 +1,71 @@
+#ifndef CORPUSREADER_H
+#define CORPUSREADER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+enum CorpusFormat {
+    CorpusPlain,
+    CorpusGzip,
+    CorpusZstd
+};
+
+
+/* Streams a corpus file into fixed size buffers.  Compressed files (gzip or
+   zstd, detected by their magic bytes) are decoded on a separate thread,
+   which fills a bounded queue of buffers while the caller consumes them.
+   This lets decompression overlap with triad counting. */
+class CorpusReader
+{
+public:
+    CorpusReader(size_t bufsize=32*1024, size_t depth=8);
+    ~CorpusReader();
+
+    bool open(const std::string &file);
+    void close();
+
+    // Swap the next decoded chunk into 'buf'.  Returns false at end of input.
+    bool next(std::vector<char> &buf);
+
+    CorpusFormat format() const { return _format; }
+    bool failed() const { return _failed; }
+
+    static CorpusFormat detectFormat(const uint8_t *magic, size_t len);
+
+private:
+    void decode();
+    bool decodePlain();
+    bool decodeGzip();
+    bool decodeZstd();
+
+    // producer side of the queue
+    std::vector<char> *acquireBuffer();
+    bool pushBuffer(std::vector<char> *buf);
+
+private:
+    FILE *_fp;
+    CorpusFormat _format;
+    size_t _bufsize;
+    size_t _depth;
+
+    std::thread _decoder;
+    std::mutex _lock;
+    std::condition_variable _filled;   // signalled when a chunk is queued
+    std::condition_variable _drained;  // signalled when a chunk is consumed
+
+    std::deque<std::vector<char> *> _queue;  // decoded chunks, oldest first
+    std::vector<std::vector<char> *> _free;  // recycled chunk buffers
+    bool _done;       // decoder has produced its last chunk
+    bool _stopping;   // consumer is closing early
+    bool _failed;     // decoder hit a read or format error
+};
+
+
+#endif
@@ -0,0 +1,185 @@
+#include <string.h>
+#include "keyboardlayoutoptimizer.h"
+#include "deltaevaluator.h"
+
+using namespace std;
+
+
+DeltaEvaluator::DeltaEvaluator()
+    : _triads(0),
+      _ntriads(0),
+      _triadcount(1),
+      _offset(0.0),
+      _effort(0),
+      _epoch(0),
+      _total(0.0),
+      _undototal(0.0)
+{
+    memset(_charcost, 0, sizeof(_charcost));
+    memset(_chartoindex, 0, sizeof(_chartoindex));
+}
+
+
+// Index the triads by character.  'effort' must be fully computed.
+void DeltaEvaluator::init(const TriadCount *triads, size_t ntriads, int triadcount, const double (*effort)[NUMKEYS][KEYSTRIDE], double offset)
+{
+    _triads = triads;
+    _ntriads = ntriads;
+    _triadcount = triadcount? triadcount: 1;
+    _offset = offset;
+    _effort = effort;
+
+    for (int c=0; c<0x100; c++)
+        _chartriads[c].clear();
+
+    for (size_t i=0; i<ntriads; i++) {
+        const uint8_t *c = triads[i].c;
+        _chartriads[c[0]].push_back(i);
+        if (c[1] != c[0])
+            _chartriads[c[1]].push_back(i);
+        if (c[2] != c[0] && c[2] != c[1])
+            _chartriads[c[2]].push_back(i);
+    }
+
+    _cost.assign(ntriads, 0.0);
+    _stamp.assign(ntriads, 0);
+    _epoch = 0;
+}
+
+
+inline double DeltaEvaluator::triadCost(const TriadCount &t) const
+{
+    return _effort[_chartoindex[t.c[0]]][_chartoindex[t.c[1]]][_chartoindex[t.c[2]]] * t.count;
+}
+
+
+// Add 'cost' to the totals of the characters making up 't'
+inline void DeltaEvaluator::addCost(const TriadCount &t, double cost)
+{
+    cost /= 3.0;
+    _charcost[t.c[0]] += cost;
+    _charcost[t.c[1]] += cost;
+    _charcost[t.c[2]] += cost;
+}
+
+
+// Score 'layout' from scratch
+void DeltaEvaluator::reset(const char *layout)
+{
+    // characters that aren't on the layout map to key 0, as in buildCharToIndexMap()
+    memset(_chartoindex, 0, sizeof(_chartoindex));
+    for (int i=0; i<NUMKEYS; i++)
+        _chartoindex[(uint8_t)layout[i]] = i;
+
+    memset(_charcost, 0, sizeof(_charcost));
+    _total = 0.0;
+
+    for (size_t i=0; i<_ntriads; i++) {
+        _cost[i] = triadCost(_triads[i]);
+        addCost(_triads[i], _cost[i]);
+        _total += _cost[i];
+    }
+
+    commit();
+}
+
+
+// Start a new pass over the triads; a triad is visited once per pass
+inline void DeltaEvaluator::nextEpoch()
+{
+    if (++_epoch == 0) {
+        _stamp.assign(_ntriads, 0);
+        _epoch = 1;
+    }
+}
+
+
+double DeltaEvaluator::tryKeys(const char *layout, const int *keys, int nkeys)
+{
+    uint8_t chars[MAXMOVED];
+    uint8_t oldindex[MAXMOVED];
+    nkeys = (nkeys < MAXMOVED)? nkeys: MAXMOVED;
+
+    for (int i=0; i<nkeys; i++) {
+        chars[i] = layout[keys[i]];
+        oldindex[i] = _chartoindex[chars[i]];
+        _chartoindex[chars[i]] = keys[i];
+    }
+
+    nextEpoch();
+    double total = _total;
+
+    for (int n=0; n<nkeys; n++) {
+        const vector<int> &list = _chartriads[chars[n]];
+        for (size_t i=0; i<list.size(); i++) {
+            int t = list[i];
+            if (_stamp[t] == _epoch)
+                continue;
+            _stamp[t] = _epoch;
+            total += triadCost(_triads[t]) - _cost[t];
+        }
+    }
+
+    for (int i=nkeys; i-- > 0; )
+        _chartoindex[chars[i]] = oldindex[i];
+
+    return total / _triadcount + _offset;
+}
+
+
+double DeltaEvaluator::updateKeys(const char *layout, const int *keys, int nkeys)
+{
+    for (int i=0; i<nkeys; i++) {
+        uint8_t c = layout[keys[i]];
+        _undoindex.push_back(make_pair(c, _chartoindex[c]));
+        _chartoindex[c] = keys[i];
+    }
+
+    // re-score every triad containing a moved character, once
+    nextEpoch();
+
+    for (int n=0; n<nkeys; n++) {
+        const vector<int> &list = _chartriads[(uint8_t)layout[keys[n]]];
+        for (size_t i=0; i<list.size(); i++) {
+            int t = list[i];
+            if (_stamp[t] == _epoch)
+                continue;
+            _stamp[t] = _epoch;
+
+            double cost = triadCost(_triads[t]);
+            _undocost.push_back(make_pair(t, _cost[t]));
+            addCost(_triads[t], cost - _cost[t]);
+            _total += cost - _cost[t];
+            _cost[t] = cost;
+        }
+    }
+
+    return effort();
+}
+
+
+// Make the swaps since the last commit permanent
+void DeltaEvaluator::commit()
+{
+    _undocost.clear();
+    _undoindex.clear();
+    _undototal = _total;
+}
+
+
+// Undo the swaps since the last commit
+void DeltaEvaluator::rollback()
+{
+    for (size_t i=_undocost.size(); i-- > 0; ) {
+        int t = _undocost[i].first;
+        addCost(_triads[t], _undocost[i].second - _cost[t]);
+        _cost[t] = _undocost[i].second;
+    }
+
+    for (size_t i=_undoindex.size(); i-- > 0; )
+        _chartoindex[_undoindex[i].first] = _undoindex[i].second;
+
+    _total = _undototal;
+    _undocost.clear();
+    _undoindex.clear();
+}
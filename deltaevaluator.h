@@ -0,0 +1,81 @@
+#ifndef DELTAEVALUATOR_H
+#define DELTAEVALUATOR_H
+
+#include <stdint.h>
+#include <vector>
+#include "configuration.h"
+
+struct TriadCount;
+
+// most keys a single tryKeys() call can take
+#define MAXMOVED 16
+
+
+/* Keeps the effort of one layout up to date as keys are swapped, by
+   re-scoring only the triads that contain a moved character.
+
+   Each triad's weighted cost is also split evenly between the characters it
+   is made of, which gives every key its share of the total effort.
+
+   A move can be scored without changing anything (tryKeys), which is all a
+   rejected move needs, or applied (updateKeys) and later rolled back to the
+   last commit().
+
+   The triads may be only part of the corpus; 'offset' then stands in for
+   the effort of the rest. */
+class DeltaEvaluator
+{
+public:
+    DeltaEvaluator();
+
+    void init(const TriadCount *triads, size_t ntriads, int triadcount, const double (*effort)[NUMKEYS][KEYSTRIDE], double offset=0.0);
+    void reset(const char *layout);
+
+    // 'keys' lists the keys of 'layout' whose characters changed since the
+    // last update.  tryKeys() returns the effort of 'layout' leaving the state
+    // alone; updateKeys() brings the state up to date and returns the effort.
+    double tryKeys(const char *layout, const int *keys, int nkeys);
+    double updateKeys(const char *layout, const int *keys, int nkeys);
+    double swapKeys(const char *layout, int key1, int key2)
+    {
+        int keys[2] = { key1, key2 };
+        return updateKeys(layout, keys, 2);
+    }
+
+    void commit();
+    void rollback();
+
+    double effort() const { return _total / _triadcount + _offset; }
+
+    // share of effort() caused by the character 'c'
+    double contribution(uint8_t c) const { return _charcost[c] / _triadcount; }
+
+private:
+    double triadCost(const TriadCount &t) const;
+    void addCost(const TriadCount &t, double cost);
+    void nextEpoch();
+
+private:
+    const TriadCount *_triads;
+    size_t _ntriads;
+    double _triadcount;
+    double _offset;
+    const double (*_effort)[NUMKEYS][KEYSTRIDE];
+
+    std::vector<int> _chartriads[0x100];  // indices of the triads containing each character
+    std::vector<double> _cost;            // current weighted cost of each triad
+    std::vector<unsigned int> _stamp;     // marks triads already re-scored by this swap
+    unsigned int _epoch;
+
+    double _charcost[0x100];
+    uint8_t _chartoindex[0x100];
+    double _total;
+
+    // undo log since the last commit
+    std::vector<std::pair<int, double> > _undocost;
+    std::vector<std::pair<uint8_t, uint8_t> > _undoindex;
+    double _undototal;
+};
+
+
+#endif
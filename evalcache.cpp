@@ -0,0 +1,50 @@
+#include "evalcache.h"
+
+
+// splitmix64, to fill the Zobrist table with well mixed values
+static uint64_t next_random(uint64_t &state)
+{
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+EvalCache::EvalCache(int bits)
+    : _entries(1UL << bits),
+      _mask((1UL << bits) - 1),
+      _lookups(0),
+      _hits(0)
+{
+    // A fixed seed keeps hashes identical from run to run
+    uint64_t state = 0x4B4C4F;
+    for (int i=0; i<NUMKEYS; i++) {
+        for (int c=0; c<0x80; c++) {
+            _zobrist[i][c] = next_random(state);
+        }
+    }
+
+    clear();
+}
+
+
+uint64_t EvalCache::hash(const char *layout) const
+{
+    uint64_t h = 0;
+    for (int i=0; i<NUMKEYS; i++)
+        h ^= _zobrist[i][layout[i] & 0x7F];
+    return h;
+}
+
+
+// Forget all cached efforts, e.g. after the corpus changes
+void EvalCache::clear()
+{
+    // hash 0 never matches a real layout in practice, so it marks empty slots
+    for (size_t i=0; i<_entries.size(); i++) {
+        _entries[i].hash = 0;
+        _entries[i].effort = 0.0;
+    }
+    resetStats();
+}
@@ -0,0 +1,70 @@
+#ifndef EVALCACHE_H
+#define EVALCACHE_H
+
+#include <stdint.h>
+#include <vector>
+#include "configuration.h"
+
+
+/* Fixed size cache of layout efforts, keyed by a Zobrist hash of the layout.
+
+   The hash is the xor of one random 64 bit value per (key index, character)
+   pair, so swapping two keys updates it in O(1).  The cache is direct mapped
+   and owned by a single optimizer, so it needs no locking.  */
+class EvalCache
+{
+public:
+    EvalCache(int bits=16);
+
+    uint64_t hash(const char *layout) const;
+
+    // Update 'h' for swapping the characters at key1 and key2.  Works on
+    // either side of the swap, since the update is its own inverse.
+    uint64_t swapHash(uint64_t h, const char *layout, int key1, int key2) const
+    {
+        uint8_t c1 = layout[key1] & 0x7F;
+        uint8_t c2 = layout[key2] & 0x7F;
+        return h ^ _zobrist[key1][c1] ^ _zobrist[key2][c2] ^ _zobrist[key1][c2] ^ _zobrist[key2][c1];
+    }
+
+    bool lookup(uint64_t h, double &effort)
+    {
+        const Entry &e = _entries[h & _mask];
+        _lookups++;
+        if (e.hash != h)
+            return false;
+        _hits++;
+        effort = e.effort;
+        return true;
+    }
+
+    void store(uint64_t h, double effort)
+    {
+        Entry &e = _entries[h & _mask];
+        e.hash = h;
+        e.effort = effort;
+    }
+
+    void clear();
+    void resetStats() { _lookups = _hits = 0; }
+
+    long lookups() const { return _lookups; }
+    long hits() const { return _hits; }
+    double hitRate() const { return _lookups? (double)_hits/_lookups: 0.0; }
+
+private:
+    struct Entry {
+        uint64_t hash;
+        double effort;
+    };
+
+    uint64_t _zobrist[NUMKEYS][0x80];
+    std::vector<Entry> _entries;
+    uint64_t _mask;
+
+    long _lookups;
+    long _hits;
+};
+
+
+#endif
@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <thread>
+#include "keyboardlayoutoptimizer.h"
+#include "exactsolver.h"
+
+using namespace std;
+
+
+// relative slack on the bound, so rounding never prunes a better arrangement
+static const double BOUND_TOLERANCE = 1e-12;
+
+
+// Cost of the cheapest assignment of n rows to n columns of 'cost' (row
+// major), by the Hungarian method
+static double assignment(const double *cost, int n)
+{
+    double u[MAXSUBSET+1], v[MAXSUBSET+1], minv[MAXSUBSET+1];
+    int match[MAXSUBSET+1], way[MAXSUBSET+1];
+    bool used[MAXSUBSET+1];
+
+    for (int j=0; j<=MAXSUBSET; j++) {
+        u[j] = v[j] = 0.0;
+        match[j] = 0;
+        way[j] = 0;
+    }
+
+    for (int i=1; i<=n; i++) {
+        match[0] = i;
+        int j0 = 0;
+        for (int j=0; j<=n; j++) {
+            minv[j] = DBL_MAX;
+            used[j] = false;
+        }
+
+        do {
+            used[j0] = true;
+            int i0 = match[j0];
+            int j1 = 0;
+            double delta = DBL_MAX;
+            for (int j=1; j<=n; j++) {
+                if (used[j])
+                    continue;
+                double cur = cost[(i0-1)*n + j-1] - u[i0] - v[j];
+                if (cur < minv[j]) {
+                    minv[j] = cur;
+                    way[j] = j0;
+                }
+                if (minv[j] < delta) {
+                    delta = minv[j];
+                    j1 = j;
+                }
+            }
+            for (int j=0; j<=n; j++) {
+                if (used[j]) {
+                    u[match[j]] += delta;
+                    v[j] -= delta;
+                } else {
+                    minv[j] -= delta;
+                }
+            }
+            j0 = j1;
+        } while (match[j0] != 0);
+
+        do {
+            int j1 = way[j0];
+            match[j0] = match[j1];
+            j0 = j1;
+        } while (j0);
+    }
+
+    return -v[0];
+}
+
+
+
+ExactSolver::ExactSolver(const TriadCount *triads, size_t ntriads, const double (*effort)[NUMKEYS][KEYSTRIDE])
+    : _triads(triads),
+      _ntriads(ntriads),
+      _effort(effort),
+      _k(0),
+      _constant(0.0),
+      _splitdepth(0),
+      _outstanding(0),
+      _bestbound(DBL_MAX),
+      _best(DBL_MAX),
+      _nodes(0)
+{
+    memset(_keys, 0, sizeof(_keys));
+    memset(_positions, 0, sizeof(_positions));
+    memset(_bestassign, 0, sizeof(_bestassign));
+}
+
+
+// Weighted cost of 't' with the key of rank 'rank' at 'pos' and the other
+// placed keys where 'assign' has them
+inline double ExactSolver::triadCost(const Triad &t, const int *assign, int rank, int pos) const
+{
+    int p[3];
+    for (int i=0; i<3; i++) {
+        int s = t.slot[i];
+        p[i] = (s < 0)? -1-s: (s == rank)? pos: assign[s];
+    }
+    return _effort[p[0]][p[1]][p[2]] * t.count;
+}
+
+
+bool ExactSolver::solve(char *layout, const string &keys, int threads)
+{
+    int rankof[0x100];
+    double weight[0x100];
+    uint8_t chartoindex[0x100];
+
+    // characters that aren't on the layout map to key 0, as elsewhere
+    memset(chartoindex, 0, sizeof(chartoindex));
+    for (int i=0; i<NUMKEYS; i++)
+        chartoindex[(uint8_t)layout[i]] = i;
+
+    for (int c=0; c<0x100; c++) {
+        rankof[c] = -1;
+        weight[c] = 0.0;
+    }
+
+    _k = 0;
+    for (size_t i=0; i<keys.length(); i++) {
+        uint8_t c = keys[i];
+        if (rankof[c] >= 0)
+            continue;
+        if (!memchr(layout, c, NUMKEYS)) {
+            printf("'%c' is not on the layout\n", c);
+            return false;
+        }
+        if (_k == MAXSUBSET) {
+            printf("At most %d keys can be placed exactly\n", MAXSUBSET);
+            return false;
+        }
+        rankof[c] = 0;
+        _keys[_k++] = c;
+    }
+
+    // place the most frequent keys first; they decide the most cost
+    for (size_t i=0; i<_ntriads; i++) {
+        const uint8_t *c = _triads[i].c;
+        weight[c[0]] += _triads[i].count;
+        if (c[1] != c[0])
+            weight[c[1]] += _triads[i].count;
+        if (c[2] != c[0] && c[2] != c[1])
+            weight[c[2]] += _triads[i].count;
+    }
+
+    for (int i=1; i<_k; i++) {
+        for (int j=i; j>0 && weight[_keys[j]] > weight[_keys[j-1]]; j--)
+            swap(_keys[j], _keys[j-1]);
+    }
+
+    for (int r=0; r<_k; r++) {
+        rankof[_keys[r]] = r;
+        _positions[r] = chartoindex[_keys[r]];
+    }
+
+    // split the triads into the fixed part and the part the keys affect
+    _subset.clear();
+    _bymax.assign(_k, vector<int>());
+    _unplacedlowest.assign(_k+1, 0.0);
+    _constant = 0.0;
+
+    for (size_t i=0; i<_ntriads; i++) {
+        const TriadCount &tc = _triads[i];
+        Triad t;
+        int ranks[3];
+        int nranks = 0;
+
+        t.count = tc.count;
+        for (int j=0; j<3; j++) {
+            int r = rankof[tc.c[j]];
+            t.slot[j] = (r < 0)? -1 - chartoindex[tc.c[j]]: r;
+        }
+
+        // its distinct keys being placed, in rank order
+        for (int j=0; j<3; j++) {
+            int r = t.slot[j];
+            if (r < 0 || (nranks > 0 && ranks[0] == r) || (nranks > 1 && ranks[1] == r))
+                continue;
+            int k = nranks++;
+            for (; k>0 && ranks[k-1] > r; k--)
+                ranks[k] = ranks[k-1];
+            ranks[k] = r;
+        }
+
+        if (!nranks) {
+            _constant += _effort[chartoindex[tc.c[0]]][chartoindex[tc.c[1]]][chartoindex[tc.c[2]]] * tc.count;
+            continue;
+        }
+
+        t.maxrank = ranks[nranks-1];
+        t.secondrank = (nranks > 1)? ranks[nranks-2]: -1;
+
+        // cheapest over every way of putting its keys on the positions,
+        // distinct or not
+        int assign[MAXSUBSET];
+        int choice[3] = { 0, 0, 0 };
+        t.lowest = DBL_MAX;
+        for (;;) {
+            for (int j=0; j<nranks; j++)
+                assign[ranks[j]] = _positions[choice[j]];
+            t.lowest = min(t.lowest, triadCost(t, assign, -1, 0));
+
+            int j = 0;
+            while (j < nranks && ++choice[j] == _k)
+                choice[j++] = 0;
+            if (j == nranks)
+                break;
+        }
+
+        _subset.push_back(t);
+    }
+
+    for (size_t i=0; i<_subset.size(); i++) {
+        for (int d=0; d<=_subset[i].secondrank; d++)
+            _unplacedlowest[d] += _subset[i].lowest;
+    }
+
+    for (int second=-1; second<_k; second++) {
+        for (size_t i=0; i<_subset.size(); i++) {
+            if (_subset[i].secondrank == second)
+                _bymax[_subset[i].maxrank].push_back(i);
+        }
+    }
+
+    // start from the best arrangement a few swaps away from the current one
+    int assign[MAXSUBSET];
+    memcpy(assign, _positions, sizeof(assign));
+    _best = localSearch(assign);
+    memcpy(_bestassign, assign, sizeof(_bestassign));
+    _bestbound = _best;
+
+    if (threads < 1)
+        threads = 1;
+    _splitdepth = min(2, _k-1);
+    _nodes = 0;
+
+    for (int i=0; i<threads; i++) {
+        _workers.push_back(new Worker);
+        _workers[i]->nodes = 0;
+    }
+
+    Task root;
+    root.depth = 0;
+    root.partial = 0.0;
+    memset(root.assign, 0, sizeof(root.assign));
+    _workers[0]->tasks.push_back(root);
+    _outstanding = 1;
+
+    vector<thread> pool;
+    for (int i=1; i<threads; i++)
+        pool.push_back(thread(&ExactSolver::run, this, i));
+    run(0);
+    for (size_t i=0; i<pool.size(); i++)
+        pool[i].join();
+
+    for (int i=0; i<threads; i++) {
+        _nodes += _workers[i]->nodes;
+        delete _workers[i];
+    }
+    _workers.clear();
+
+    for (int r=0; r<_k; r++)
+        layout[_bestassign[r]] = _keys[r];
+
+    return true;
+}
+
+
+// Subset part of the cost of a complete arrangement
+double ExactSolver::assignmentCost(const int *assign) const
+{
+    double cost = 0.0;
+    for (size_t i=0; i<_subset.size(); i++)
+        cost += triadCost(_subset[i], assign, -1, 0);
+    return cost;
+}
+
+
+// Improve 'assign' by swapping pairs of keys until no swap helps
+double ExactSolver::localSearch(int *assign)
+{
+    double cost = assignmentCost(assign);
+
+    bool improved = true;
+    while (improved) {
+        improved = false;
+        for (int i=0; i<_k; i++) {
+            for (int j=i+1; j<_k; j++) {
+                swap(assign[i], assign[j]);
+                double c = assignmentCost(assign);
+                if (c < cost) {
+                    cost = c;
+                    improved = true;
+                } else {
+                    swap(assign[i], assign[j]);
+                }
+            }
+        }
+    }
+
+    return cost;
+}
+
+
+void ExactSolver::run(int id)
+{
+    Task task;
+    while (nextTask(id, task)) {
+        search(id, task);
+        _outstanding--;
+    }
+}
+
+
+// Take the newest task from our own deque, or else steal the oldest from
+// another thread's.  Returns false once every task is finished.
+bool ExactSolver::nextTask(int id, Task &task)
+{
+    int nworkers = _workers.size();
+
+    for (;;) {
+        for (int i=0; i<nworkers; i++) {
+            Worker &w = *_workers[(id+i) % nworkers];
+            lock_guard<mutex> guard(w.lock);
+            if (w.tasks.empty())
+                continue;
+            if (i == 0) {
+                task = w.tasks.back();
+                w.tasks.pop_back();
+            } else {
+                task = w.tasks.front();
+                w.tasks.pop_front();
+            }
+            return true;
+        }
+
+        if (_outstanding == 0)
+            return false;
+        this_thread::yield();
+    }
+}
+
+
+void ExactSolver::search(int id, Task &node)
+{
+    Worker &worker = *_workers[id];
+    worker.nodes++;
+
+    int d = node.depth;
+    if (d == _k) {
+        if (node.partial < _bestbound)
+            improve(node);
+        return;
+    }
+
+    int n = _k - d;
+    int freepos[MAXSUBSET];
+    int nfree = 0;
+    for (int i=0; i<_k; i++) {
+        if (find(node.assign, node.assign+d, _positions[i]) == node.assign+d)
+            freepos[nfree++] = _positions[i];
+    }
+
+    // cost[r][j]: triads whose only unplaced key is the one of rank d+r, with
+    // that key on freepos[j]
+    double cost[MAXSUBSET*MAXSUBSET];
+    memset(cost, 0, n*n*sizeof(double));
+
+    for (int r=d; r<_k; r++) {
+        const vector<int> &list = _bymax[r];
+        double *row = cost + (r-d)*n;
+        for (size_t i=0; i<list.size(); i++) {
+            const Triad &t = _subset[list[i]];
+            if (t.secondrank >= d)
+                break;
+            for (int j=0; j<n; j++)
+                row[j] += triadCost(t, node.assign, r, freepos[j]);
+        }
+    }
+
+    double bound = node.partial + _unplacedlowest[d] + assignment(cost, n);
+    double best = _bestbound;
+    if (bound - BOUND_TOLERANCE*best >= best)
+        return;
+
+    // Every triad whose last key has rank d is complete once it's placed,
+    // so row 0 is exactly what placing it on each position adds.  Try the
+    // cheapest first.
+    int order[MAXSUBSET];
+    for (int j=0; j<n; j++)
+        order[j] = j;
+    for (int i=1; i<n; i++) {
+        for (int j=i; j>0 && cost[order[j]] < cost[order[j-1]]; j--)
+            swap(order[j], order[j-1]);
+    }
+
+    Task child;
+    child.depth = d+1;
+    memcpy(child.assign, node.assign, sizeof(child.assign));
+
+    if (d < _splitdepth) {
+        // queue them for stealing, cheapest at the back where we pop from
+        lock_guard<mutex> guard(worker.lock);
+        for (int i=n-1; i>=0; i--) {
+            child.assign[d] = freepos[order[i]];
+            child.partial = node.partial + cost[order[i]];
+            _outstanding++;
+            worker.tasks.push_back(child);
+        }
+        return;
+    }
+
+    for (int i=0; i<n; i++) {
+        child.assign[d] = freepos[order[i]];
+        child.partial = node.partial + cost[order[i]];
+        search(id, child);
+    }
+}
+
+
+void ExactSolver::improve(const Task &leaf)
+{
+    lock_guard<mutex> guard(_bestlock);
+    if (leaf.partial < _best) {
+        _best = leaf.partial;
+        memcpy(_bestassign, leaf.assign, sizeof(_bestassign));
+        _bestbound = _best;
+    }
+}
+
+
+
+// Place 'keys' optimally on 'layout', leaving every other key where it is
+bool KeyboardLayoutOptimizer::solveExact(char *layout, const string &keys, int threads)
+{
+    char start[NUMKEYS+1];
+    memcpy(start, layout, NUMKEYS+1);
+
+    printf("Placing \"%s\" exactly, %d threads\n", keys.c_str(), threads);
+
+    struct timeval begin, end;
+    gettimeofday(&begin, NULL);
+
+    ExactSolver solver(_triadtable, _ntriads, _triadeffort);
+    if (!solver.solve(layout, keys, threads))
+        return false;
+
+    gettimeofday(&end, NULL);
+    double elapsed = (end.tv_sec - begin.tv_sec) + (end.tv_usec - begin.tv_usec)/1e6;
+
+    double before = computeLayoutEffort(start);
+    double after = computeLayoutEffort(layout);
+
+    printLayoutsSideBySide(start, layout);
+    printf("%3.6f -> %3.6f (optimal)\n", before, after);
+    printf("exact: %ld nodes in %.2f seconds (%.0f nodes per second)\n",
+           solver.nodes(), elapsed, solver.nodes()/max(elapsed, 1e-6));
+    printf("%3.6f = \"%s\"\n", after, layout);
+    return true;
+}
@@ -0,0 +1,102 @@
+#ifndef EXACTSOLVER_H
+#define EXACTSOLVER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include "configuration.h"
+
+struct TriadCount;
+
+
+// most keys ExactSolver can place
+#define MAXSUBSET 16
+
+
+/* Finds the provably best arrangement of a few keys, with the rest of the
+   layout fixed: the keys are permuted among the positions they start on.
+
+   This is a quadratic (in fact cubic, since costs come from triads)
+   assignment problem, solved by depth-first branch and bound.  Keys are
+   placed most frequent first.  At each node the bound is
+
+     exact cost of triads whose keys are all placed
+   + a Gilmore-Lawler term: the cost of each triad with one unplaced key,
+     for every free position, solved as a linear assignment problem
+   + for triads with two or more unplaced keys, their cheapest cost over
+     any of the positions (computed once)
+
+   The tree is searched by several threads.  Shallow nodes are queued as
+   tasks on the thread's own deque, and idle threads steal from the far end
+   of the others' deques. */
+class ExactSolver
+{
+public:
+    ExactSolver(const TriadCount *triads, size_t ntriads, const double (*effort)[NUMKEYS][KEYSTRIDE]);
+
+    // Rearrange 'keys' within 'layout' optimally.  Returns false if the keys
+    // aren't all on the layout or there are too many of them.
+    bool solve(char *layout, const std::string &keys, int threads);
+
+    double cost() const { return _constant + _best; }   // total weighted effort
+    long nodes() const { return _nodes; }
+
+private:
+    // a triad with at least one key being placed
+    struct Triad {
+        int count;
+        int slot[3];      // rank of the key being placed, or -1-position of a fixed key
+        int maxrank;      // last of its keys to be placed
+        int secondrank;   // the one before that, or -1 if only one key is placed
+        double lowest;    // least cost over all placements
+    };
+
+    struct Task {
+        int depth;
+        double partial;
+        int assign[MAXSUBSET];   // position of each key placed so far, by rank
+    };
+
+    struct Worker {
+        std::mutex lock;
+        std::deque<Task> tasks;
+        long nodes;
+    };
+
+    double triadCost(const Triad &t, const int *assign, int rank, int pos) const;
+    void run(int id);
+    bool nextTask(int id, Task &task);
+    void search(int id, Task &node);
+    void improve(const Task &leaf);
+    double localSearch(int *assign);
+    double assignmentCost(const int *assign) const;
+
+private:
+    const TriadCount *_triads;
+    size_t _ntriads;
+    const double (*_effort)[NUMKEYS][KEYSTRIDE];
+
+    int _k;
+    uint8_t _keys[MAXSUBSET];                // keys being placed, by rank
+    int _positions[MAXSUBSET];               // the places they share
+    std::vector<Triad> _subset;
+    std::vector<std::vector<int> > _bymax;   // triads by maxrank, ordered by secondrank
+    std::vector<double> _unplacedlowest;     // by depth: sum of 'lowest' of triads with 2+ unplaced keys
+    double _constant;                        // cost of the triads not involving the keys
+
+    int _splitdepth;
+    std::vector<Worker *> _workers;
+    std::atomic<long> _outstanding;
+
+    std::mutex _bestlock;
+    std::atomic<double> _bestbound;
+    double _best;
+    int _bestassign[MAXSUBSET];
+    long _nodes;
+};
+
+
+#endif
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <vector>
+#include "island.h"
+
+using namespace std;
+
+
+// seconds an island waits on the hub before giving up on it
+static const int HUB_TIMEOUT = 10;
+
+
+MigrationChannel *MigrationChannel::create(const string &spec)
+{
+    if (spec.compare(0, 4, "shm:") == 0) {
+        ShmChannel *chan = new ShmChannel;
+        if (chan->open(spec.substr(4)))
+            return chan;
+        delete chan;
+
+    } else if (spec.compare(0, 4, "tcp:") == 0) {
+        size_t colon = spec.rfind(':');
+        TcpChannel *chan = new TcpChannel;
+        if (colon > 3 && chan->open(spec.substr(4, colon-4), atoi(spec.c_str()+colon+1)))
+            return chan;
+        delete chan;
+
+    } else {
+        fprintf(stderr, "Unknown migration channel '%s' (expected shm:NAME or tcp:HOST:PORT)\n", spec.c_str());
+    }
+
+    return 0;
+}
+
+
+
+// One island's published layout.  Each slot has a single writer (its own
+// island) and is guarded by a sequence counter, which is odd while a write is
+// in progress; readers retry if it changed under them.  A named segment may
+// outlive a run, so each slot has the time it was written.
+struct IslandSlot {
+    uint32_t seq;
+    int32_t used;
+    int64_t stamp;
+    double effort;
+    char layout[NUMKEYS+1];
+};
+
+
+// Wall clock time in nanoseconds, which all processes on a host agree on
+static int64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// Bumped whenever the layout of a Segment changes
+static const uint32_t SEGMENT_VERSION = 2;
+
+struct Segment {
+    uint32_t version;
+    IslandSlot slots[MAXISLANDS];
+};
+
+
+ShmChannel::ShmChannel()
+    : _segment(0),
+      _opened(0)
+{
+}
+
+
+ShmChannel::~ShmChannel()
+{
+    if (_segment)
+        munmap(_segment, sizeof(Segment));
+}
+
+
+// Attach to (creating if needed) the segment shared by all islands of a run.
+// Slots written before this are left over from an earlier run, and ignored.
+bool ShmChannel::open(const string &name)
+{
+    string shmname = (name[0] == '/')? name: "/" + name;
+
+    int fd = shm_open(shmname.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        perror("shm_open");
+        return false;
+    }
+
+    // a newly created segment is zero filled, ie. no slot is used yet
+    if (ftruncate(fd, sizeof(Segment)) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return false;
+    }
+
+    void *p = mmap(0, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    // a segment left by an older version can't be read, so start it afresh
+    _segment = (Segment *)p;
+    if (__atomic_load_n(&_segment->version, __ATOMIC_ACQUIRE) != SEGMENT_VERSION) {
+        memset(_segment->slots, 0, sizeof(_segment->slots));
+        __atomic_store_n(&_segment->version, SEGMENT_VERSION, __ATOMIC_RELEASE);
+    }
+    _opened = now();
+    return true;
+}
+
+
+bool ShmChannel::publish(int island, double effort, const char *layout)
+{
+    if (island < 0 || island >= MAXISLANDS)
+        return false;
+
+    IslandSlot &slot = _segment->slots[island];
+    __atomic_fetch_add(&slot.seq, 1, __ATOMIC_ACQ_REL);
+    slot.stamp = now();
+    slot.effort = effort;
+    memcpy(slot.layout, layout, NUMKEYS);
+    slot.layout[NUMKEYS] = 0;
+    slot.used = 1;
+    __atomic_fetch_add(&slot.seq, 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+
+bool ShmChannel::fetchBest(int island, double &effort, char *layout)
+{
+    bool found = false;
+
+    for (int i=0; i<MAXISLANDS; i++) {
+        if (i == island)
+            continue;
+
+        const IslandSlot &slot = _segment->slots[i];
+        IslandSlot copy;
+        uint32_t seq;
+
+        // give up on a slot that keeps changing; it'll be read next time
+        int tries = 0;
+        do {
+            seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+            memcpy(&copy, &slot, sizeof(copy));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((seq & 1 || seq != __atomic_load_n(&slot.seq, __ATOMIC_RELAXED)) && ++tries < 100);
+
+        if (tries == 100 || !copy.used || copy.stamp < _opened)
+            continue;
+
+        if (!found || copy.effort < effort) {
+            effort = copy.effort;
+            memcpy(layout, copy.layout, NUMKEYS);
+            layout[NUMKEYS] = 0;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+
+
+/* The tcp protocol is line based:
+     PUT <island> <effort> <layout>   ->  OK
+     GET <island>                     ->  <effort> <layout>  |  NONE
+   Layouts never contain whitespace, so they are sent as is. */
+
+TcpChannel::TcpChannel()
+    : _fd(-1)
+{
+}
+
+
+TcpChannel::~TcpChannel()
+{
+    if (_fd >= 0)
+        close(_fd);
+}
+
+
+bool TcpChannel::open(const string &host, int port)
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host.c_str(), service, &hints, &res) != 0) {
+        fprintf(stderr, "Unable to resolve migration hub '%s'\n", host.c_str());
+        return false;
+    }
+
+    for (struct addrinfo *ai=res; ai; ai=ai->ai_next) {
+        _fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (_fd < 0)
+            continue;
+
+        // a hung hub mustn't stall the island; the send timeout also
+        // bounds connect()
+        struct timeval timeout = { HUB_TIMEOUT, 0 };
+        setsockopt(_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        if (connect(_fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(_fd);
+        _fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (_fd < 0) {
+        fprintf(stderr, "Unable to connect to migration hub %s:%d\n", host.c_str(), port);
+        return false;
+    }
+    return true;
+}
+
+
+// Send one request line and read back one reply line.  If the hub fails
+// to answer in time the connection is dropped, since a late reply would be
+// taken for that of the next request; the island then carries on alone.
+bool TcpChannel::request(const string &line, string &reply)
+{
+    if (_fd < 0)
+        return false;
+
+    size_t sent = 0;
+    while (sent < line.length()) {
+        ssize_t n = write(_fd, line.data()+sent, line.length()-sent);
+        if (n <= 0) {
+            disconnect();
+            return false;
+        }
+        sent += n;
+    }
+
+    reply.clear();
+    char c;
+    while (read(_fd, &c, 1) == 1) {
+        if (c == '\n')
+            return true;
+        reply += c;
+    }
+    disconnect();
+    return false;
+}
+
+
+void TcpChannel::disconnect()
+{
+    fprintf(stderr, "Lost the migration hub; continuing without migration\n");
+    close(_fd);
+    _fd = -1;
+}
+
+
+bool TcpChannel::publish(int island, double effort, const char *layout)
+{
+    char line[128];
+    snprintf(line, sizeof(line), "PUT %d %.17g %.*s\n", island, effort, NUMKEYS, layout);
+
+    string reply;
+    return request(line, reply) && reply == "OK";
+}
+
+
+bool TcpChannel::fetchBest(int island, double &effort, char *layout)
+{
+    char line[32];
+    snprintf(line, sizeof(line), "GET %d\n", island);
+
+    string reply;
+    if (!request(line, reply) || reply == "NONE")
+        return false;
+
+    char buf[NUMKEYS+1];
+    if (sscanf(reply.c_str(), "%lf %47s", &effort, buf) != 2 || strlen(buf) != NUMKEYS)
+        return false;
+
+    memcpy(layout, buf, NUMKEYS+1);
+    return true;
+}
+
+
+
+int runMigrationHub(int port)
+{
+    int listener = socket(AF_INET6, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 16) < 0) {
+        perror("bind");
+        close(listener);
+        return 1;
+    }
+
+    printf("Migration hub listening on port %d\n", port);
+    fflush(stdout);
+
+    bool used[MAXISLANDS] = { false };
+    double efforts[MAXISLANDS];
+    string layouts[MAXISLANDS];
+
+    vector<struct pollfd> fds(1);
+    vector<string> pending(1);
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+
+    for (;;) {
+        if (poll(&fds[0], fds.size(), -1) < 0)
+            continue;
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, 0, 0);
+            if (fd >= 0) {
+                struct pollfd pfd = { fd, POLLIN, 0 };
+                fds.push_back(pfd);
+                pending.push_back("");
+            }
+        }
+
+        for (size_t i=fds.size(); i-- > 1; ) {
+            if (!fds[i].revents)
+                continue;
+
+            char buf[4096];
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+            if (n <= 0) {
+                close(fds[i].fd);
+                fds.erase(fds.begin()+i);
+                pending.erase(pending.begin()+i);
+                continue;
+            }
+            pending[i].append(buf, n);
+
+            size_t eol;
+            while ((eol = pending[i].find('\n')) != string::npos) {
+                string line = pending[i].substr(0, eol);
+                pending[i].erase(0, eol+1);
+
+                int island;
+                double effort;
+                char layout[NUMKEYS+1];
+                string reply = "ERROR\n";
+
+                if (sscanf(line.c_str(), "PUT %d %lf %47s", &island, &effort, layout) == 3 &&
+                    island >= 0 && island < MAXISLANDS && strlen(layout) == NUMKEYS) {
+                    used[island] = true;
+                    efforts[island] = effort;
+                    layouts[island] = layout;
+                    reply = "OK\n";
+
+                } else if (sscanf(line.c_str(), "GET %d", &island) == 1) {
+                    int best = -1;
+                    for (int j=0; j<MAXISLANDS; j++) {
+                        if (j != island && used[j] && (best < 0 || efforts[j] < efforts[best]))
+                            best = j;
+                    }
+                    if (best < 0) {
+                        reply = "NONE\n";
+                    } else {
+                        char out[128];
+                        snprintf(out, sizeof(out), "%.17g %s\n", efforts[best], layouts[best].c_str());
+                        reply = out;
+                    }
+                }
+
+                if (write(fds[i].fd, reply.data(), reply.length()) < 0)
+                    break;
+            }
+        }
+    }
+
+    return 0;
+}
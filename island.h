@@ -0,0 +1,73 @@
+#ifndef ISLAND_H
+#define ISLAND_H
+
+#include <stdint.h>
+#include <string>
+#include "configuration.h"
+
+
+#define MAXISLANDS 64
+
+
+/* Exchanges layouts between cooperating optimizer processes ("islands").
+   Each island periodically publishes its best layout, and may import the
+   best layout published by any other island. */
+class MigrationChannel
+{
+public:
+    virtual ~MigrationChannel() {}
+
+    virtual bool publish(int island, double effort, const char *layout) = 0;
+
+    // Best layout published by any island other than 'island'
+    virtual bool fetchBest(int island, double &effort, char *layout) = 0;
+
+    // "shm:NAME" or "tcp:HOST:PORT"
+    static MigrationChannel *create(const std::string &spec);
+};
+
+
+// Islands on one host, sharing a POSIX shared memory segment
+class ShmChannel : public MigrationChannel
+{
+public:
+    ShmChannel();
+    ~ShmChannel();
+
+    bool open(const std::string &name);
+
+    bool publish(int island, double effort, const char *layout);
+    bool fetchBest(int island, double &effort, char *layout);
+
+private:
+    struct Segment *_segment;
+    int64_t _opened;
+};
+
+
+// Islands on several hosts, talking to a hub started with runMigrationHub()
+class TcpChannel : public MigrationChannel
+{
+public:
+    TcpChannel();
+    ~TcpChannel();
+
+    bool open(const std::string &host, int port);
+
+    bool publish(int island, double effort, const char *layout);
+    bool fetchBest(int island, double &effort, char *layout);
+
+private:
+    bool request(const std::string &line, std::string &reply);
+    void disconnect();
+
+private:
+    int _fd;
+};
+
+
+// Serve TcpChannel clients on 'port' until killed
+int runMigrationHub(int port);
+
+
+#endif
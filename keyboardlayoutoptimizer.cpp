@@ -4,9 +4,22 @@
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <math.h>
-#include <list>
+#include <float.h>
+#include <limits.h>
+#include <vector>
+#include <thread>
+#include <algorithm>
 #include "keyboardlayoutoptimizer.h"
+#include "corpusreader.h"
+#include "sweep.h"
+#include "report.h"
 
 
 char qwerty_layout[NUMKEYS+1]  = { "`1234567890-=qwertyuiop[]\\asdfghjkl;'zxcvbnm,./" };
@@ -17,15 +30,25 @@ char bulpkm_layout[NUMKEYS+1]  = { "`1234567890-='bulpkmyf;[]\\riaohdtensjzxcvqg
 char xfyl_layout[NUMKEYS+1]    = { "`1234567890-=xfyljkpuw;[]\\asinhdtero'zb.mqgc,v/" };
 char test_layout[NUMKEYS+1]    = { "`1234567890-=tkpb'oqc,.[]\\r/;sxfzvgwluyemdnihja" };
 
+// the layouts compared by showLayouts() and the report
+struct NamedLayout {
+    const char *name;
+    char *layout;
+} namedLayouts[] = {
+    { "Qwerty",  qwerty_layout  },
+    { "Dvorak",  dvorak_layout  },
+    { "Colemak", colemak_layout },
+    { "Workman", workman_layout },
+    { "Bulpkm",  bulpkm_layout  },
+    { "Xfyl",    xfyl_layout    },
+    { "Test",    test_layout    },
+};
+const int NUMNAMEDLAYOUTS = sizeof(namedLayouts)/sizeof(namedLayouts[0]);
+
 
 // table containing information on which hand, row, finger
 // a given key index corresponds to.
-struct KeyInfo {
-    HandType hand;
-    RowType row;
-    FingerType finger;
-
-} keyInfoTable[NUMKEYS] = {
+KeyInfo keyInfoTable[NUMKEYS] = {
     { LeftHand,  NumberRow,  FingerPinky  },   // `
     { LeftHand,  NumberRow,  FingerRing   },   // 1
     { LeftHand,  NumberRow,  FingerRing   },   // 2
@@ -105,13 +128,6 @@ int rowFlagTable[NUMROWS][NUMROWS][NUMROWS] = {
 };
 
 
-inline int random_range(int min, int max)
-{
-    int range = max-min+1;
-    return min+int(range*(double)rand()/(RAND_MAX+1.0));
-}
-
-
 // Specifies which keys are allowed to be swapped when optimizing
 uint8_t layoutMask[NUMKEYS] = {
   // ` 1 2 3 4 5 6 7 8 9 0 - = q w e r t y u i o p [ ] \ a s d f g h j k l ; ' z x c v b n m , . /
@@ -120,21 +136,87 @@ uint8_t layoutMask[NUMKEYS] = {
 
 
 KeyboardLayoutOptimizer::KeyboardLayoutOptimizer()
+    : _proposals(&_random)
 {
-    srand(time(0));
+    _random.setSeed(time(0));
+    initState();
 
+    _arena = new TableArena();
+    _ownsarena = true;
+    _triadeffort = _arena->effort();
+    _digraphs = _arena->digraphs();
+
+    // fill the whole table up front; it is read-only while optimizing
     for (int i=0; i<NUMKEYS; i++) {
         for (int j=0; j<NUMKEYS; j++) {
             for (int k=0; k<NUMKEYS; k++) {
-                _triadeffort[i][j][k] = 0.0;
+                _triadeffort[i][j][k] = computeTriadEffort(i, j, k);
             }
         }
     }
 }
 
 
+// Share the tables of 'shared'
+KeyboardLayoutOptimizer::KeyboardLayoutOptimizer(const KeyboardLayoutOptimizer *shared)
+    : _proposals(&_random)
+{
+    _random.setSeed(time(0));
+    initState();
+
+    // spawn() is called from the thread that will use the new optimizer
+    _arena = shared->_arena->local();
+    _ownsarena = false;
+    _triadeffort = _arena->effort();
+    _digraphs = _arena->digraphs();
+    _triadtable = shared->_triadtable;
+    _ntriads = shared->_ntriads;
+    _triadcount = shared->_triadcount;
+
+    _guided = shared->_guided;
+    _screening = shared->_screening;
+    _coverage = shared->_coverage;
+    initEvaluators();
+}
+
+
+KeyboardLayoutOptimizer *KeyboardLayoutOptimizer::spawn() const
+{
+    return new KeyboardLayoutOptimizer(this);
+}
+
+
+void KeyboardLayoutOptimizer::initState()
+{
+    _triadcount = 0;
+    memset(_chartoindex, 0, sizeof(_chartoindex));
+
+    _triadtable = 0;
+    _ntriads = 0;
+    _mapping = 0;
+    _mappingsize = 0;
+
+    _migration = 0;
+    _island = 0;
+    _migrateinterval = 0;
+    _guided = false;
+    _guidefloor = 0.0;
+    memset(_guideweights, 0, sizeof(_guideweights));
+    _screening = false;
+    _coverage = 1.0;
+    _tailbound = 0.0;
+    _tailoffset = 0.0;
+    _verbose = true;
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+
 KeyboardLayoutOptimizer::~KeyboardLayoutOptimizer()
 {
+    if (_mapping)
+        munmap(_mapping, _mappingsize);
+    if (_ownsarena)
+        delete _arena;
 }
 
 
@@ -148,15 +230,97 @@ void KeyboardLayoutOptimizer::buildCharToIndexMap(char *layout)
 
 
 
-// Compute the (naive) effort for a given layout
+// Flatten _triadmap into _triads so evaluation doesn't walk the map
+void KeyboardLayoutOptimizer::buildTriadTable()
+{
+    _triads.clear();
+    _triads.reserve(_triadmap.size());
+
+    map<string, int>::iterator it;
+    for (it = _triadmap.begin(); it != _triadmap.end(); it++) {
+        TriadCount t = { { (uint8_t)it->first[0], (uint8_t)it->first[1], (uint8_t)it->first[2] }, it->second };
+        _triads.push_back(t);
+    }
+
+    _triadtable = _triads.empty()? 0: &_triads[0];
+    _ntriads = _triads.size();
+    initEvaluators();
+}
+
+
+static bool moreFrequent(const TriadCount &a, const TriadCount &b)
+{
+    return a.count > b.count;
+}
+
+
+// Set up _delta and _surrogate for the current tables.  Below full coverage
+// _delta only scores the most frequent triads, which make up that fraction
+// of the corpus.  The rest is counted at the middle of the effort table's
+// range, so on any layout it is off by at most _tailbound.
+void KeyboardLayoutOptimizer::initEvaluators()
+{
+    const double (*effort)[NUMKEYS][KEYSTRIDE] = _triadeffort;
+    _surrogate.init(_digraphs, _triadcount, effort);
+
+    _head.clear();
+    _tailbound = 0.0;
+    _tailoffset = 0.0;
+    if (_coverage >= 1.0 || _ntriads == 0) {
+        _delta.init(_triadtable, _ntriads, _triadcount, effort);
+        return;
+    }
+
+    _head.assign(_triadtable, _triadtable+_ntriads);
+    stable_sort(_head.begin(), _head.end(), moreFrequent);
+
+    long covered = 0;
+    size_t n = 0;
+    while (n < _head.size() && (n == 0 || covered < _coverage*_triadcount))
+        covered += _head[n++].count;
+    _head.resize(n);
+
+    double lowest = DBL_MAX, highest = 0.0;
+    for (int i=0; i<NUMKEYS; i++) {
+        for (int j=0; j<NUMKEYS; j++) {
+            for (int k=0; k<NUMKEYS; k++) {
+                lowest = fmin(lowest, _triadeffort[i][j][k]);
+                highest = fmax(highest, _triadeffort[i][j][k]);
+            }
+        }
+    }
+
+    double tailmass = (_triadcount - covered) / (double)_triadcount;
+    _tailbound = tailmass * (highest-lowest) / 2;
+    _tailoffset = tailmass * (highest+lowest) / 2;
+    _delta.init(&_head[0], _head.size(), _triadcount, effort, _tailoffset);
+}
+
+
+// Score only the most frequent triads, covering 'fraction' of the corpus,
+// while optimizing; 1 scores them all
+void KeyboardLayoutOptimizer::setCoverage(double fraction)
+{
+    _coverage = fraction;
+    initEvaluators();
+    _cache.clear();
+
+    if (_tailbound > 0.0) {
+        printf("truncated evaluation: %lu of %lu triads cover %.2f%% of the corpus, error bound %.6f\n",
+                _head.size(), _ntriads, 100.0*_coverage, _tailbound);
+    }
+}
+
+
+// Compute the effort for a given layout
 double KeyboardLayoutOptimizer::computeLayoutEffort(char *layout)
 {
     buildCharToIndexMap(layout);
     double effort = 0.0;
 
-    map<string, int>::iterator it;
-    for (it = _triadmap.begin(); it != _triadmap.end(); it++) {
-        effort += getTriadEffort(it->first) * it->second;
+    for (size_t i=0; i<_ntriads; i++) {
+        const TriadCount &t = _triadtable[i];
+        effort += getTriadEffort(_chartoindex[t.c[0]], _chartoindex[t.c[1]], _chartoindex[t.c[2]]) * t.count;
     }
 
     return effort / (double)_triadcount;
@@ -164,26 +328,145 @@ double KeyboardLayoutOptimizer::computeLayoutEffort(char *layout)
 
 
 
-// Generate a new layout by randomly swapping some of the keys
-void KeyboardLayoutOptimizer::swapLayoutKeys(char *layout, int minswaps, int maxswaps, uint8_t *mask)
+// Per-key weights for guided proposals, from the weights of the characters
+// on them
+void KeyboardLayoutOptimizer::proposalWeights(const char *layout, double *weights)
+{
+    for (int i=0; i<NUMKEYS; i++)
+        weights[i] = _guideweights[(uint8_t)layout[i]];
+}
+
+
+// Weigh every character of 'layout' by its share of the effort in _delta,
+// plus a floor so that well placed keys are still picked now and then
+void KeyboardLayoutOptimizer::refreshGuideWeights(const char *layout)
 {
-    int key1 = 0;
-    int key2 = 0;
+    _guidefloor = GUIDED_FLOOR * _delta.effort() / NUMKEYS;
+    for (int i=0; i<NUMKEYS; i++)
+        _guideweights[(uint8_t)layout[i]] = _delta.contribution(layout[i]) + _guidefloor;
+}
 
-    int nswaps = random_range(minswaps, maxswaps);
+
+// Re-weigh only the characters on 'keys', after a move of them was applied
+// to _delta.  The others catch up at the next refreshGuideWeights().
+void KeyboardLayoutOptimizer::updateGuideWeights(const char *layout, const int *keys, int nkeys)
+{
+    for (int i=0; i<nkeys; i++)
+        _guideweights[(uint8_t)layout[keys[i]]] = _delta.contribution(layout[keys[i]]) + _guidefloor;
+}
+
+
+// Fit the surrogate to the real change in effort of moves from 'layout',
+// where _delta and _surrogate must both be.  The moves are drawn as the
+// optimizer draws them, by a copy of its generator (so with the same
+// constraints, and by weight if guided) with random numbers of its own, so
+// the optimizer draws the same random numbers whether or not it screens.
+void KeyboardLayoutOptimizer::calibrateSurrogate(const char *layout)
+{
+    Random random(1);
+    ProposalGenerator proposals(_proposals, &random);
+
+    char trial[NUMKEYS+1];
+    memcpy(trial, layout, NUMKEYS+1);
+    double start[NUMKEYS], weights[NUMKEYS];
+    double *guide = _guided? weights: 0;
+    if (_guided)
+        proposalWeights(layout, start);
+
+    vector<Proposal> moves;
+    Proposal move;
+    int keys[MAXMOVED];
+    vector<double> estimates, actuals;
+
+    for (int n=0; n<SCREEN_SAMPLES; n++) {
+        if (_guided)
+            memcpy(weights, start, sizeof(weights));
+
+        moves.clear();
+        int nswaps = random.range(1, 3);
+        for (int i=0; i<nswaps; i++) {
+            if (!proposals.propose(trial, move, guide))
+                continue;
+            moves.push_back(move);
+            for (int j=0; _guided && j<move.nswaps; j++) {
+                double hold = weights[move.key1[j]];
+                weights[move.key1[j]] = weights[move.key2[j]];
+                weights[move.key2[j]] = hold;
+            }
+        }
+        if (moves.empty())
+            continue;
+
+        int nkeys = movedKeys(moves, keys);
+        estimates.push_back(_surrogate.tryKeys(trial, keys, nkeys));
+        actuals.push_back(_delta.tryKeys(trial, keys, nkeys) - _delta.effort());
+
+        for (size_t j=moves.size(); j-- > 0; )
+            proposals.undo(trial, moves[j]);
+    }
+
+    _surrogate.calibrate(estimates, actuals);
+}
+
+
+// Generate a new layout by randomly swapping some of the keys, and keep the
+// layout's Zobrist hash up to date.  The moves made are stored in 'moves'.
+//
+// Guided proposals draw keys by the character weights, which stay as they are
+// while the moves are made.  The Hastings ratio q(reverse)/q(forward) of the
+// moves is returned: guided moves aren't symmetric, and neither is a pair
+// moved to the other hand, when the hands have different numbers of free
+// slots.  The moves aren't scored here.
+double KeyboardLayoutOptimizer::swapLayoutKeys(char *layout, int minswaps, int maxswaps, uint64_t &hash, vector<Proposal> &moves)
+{
+    double weights[NUMKEYS];
+    double *guide = _guided? weights: 0;
+    double ratio = 1.0;
+    double forward;
+    Proposal move;
+
+    moves.clear();
+    int nswaps = _random.range(minswaps, maxswaps);
+    if (_guided)
+        proposalWeights(layout, weights);
 
     for (int i=0; i<nswaps; i++) {
-        while (key1=random_range(0, NUMKEYS), !mask[key1])
-            ;
+        if (!_proposals.propose(layout, move, guide, &forward))
+            continue;
+
+        // the weights move with their characters
+        Proposal reverse = move;
+        for (int j=0; j<move.nswaps; j++) {
+            reverse.key1[j] = move.key2[j];
+            reverse.key2[j] = move.key1[j];
+            if (_guided) {
+                double hold = weights[move.key1[j]];
+                weights[move.key1[j]] = weights[move.key2[j]];
+                weights[move.key2[j]] = hold;
+            }
+        }
+        ratio *= _proposals.probability(layout, reverse, guide) / forward;
 
-        //while (key2=random_range(0, NUMKEYS), !mask[key2] && key2 != key1)
-        while (key2=random_range(0, NUMKEYS), !mask[key2] && key2 != key1)
-            ;
-    
-        char hold = layout[key1];
-        layout[key1] = layout[key2];
-        layout[key2] = hold;    
+        for (int j=0; j<move.nswaps; j++)
+            hash = _cache.swapHash(hash, layout, move.key1[j], move.key2[j]);
+        moves.push_back(move);
+    }
+
+    return ratio;
+}
+
+
+// List the keys changed by 'moves', for DeltaEvaluator
+int KeyboardLayoutOptimizer::movedKeys(const vector<Proposal> &moves, int *keys)
+{
+    int n = 0;
+    for (size_t i=0; i<moves.size(); i++) {
+        for (int j=0; j<moves[i].nswaps; j++) {
+            keys[n++] = moves[i].key1[j];
+            keys[n++] = moves[i].key2[j];
+        }
     }
+    return n;
 }
 
 
@@ -293,6 +576,7 @@ double KeyboardLayoutOptimizer::optimizeLayout(char *layout, int iterations, dou
 {
     char prev_layout[NUMKEYS+1];
     char curr_layout[NUMKEYS+1];
+    char best_layout[NUMKEYS+1];
     double prev_effort = 0.0;
     double curr_effort = 0.0;
     double effortdelta = 0.0;
@@ -306,149 +590,453 @@ double KeyboardLayoutOptimizer::optimizeLayout(char *layout, int iterations, dou
     prev_layout[NUMKEYS]=0;
     curr_layout[NUMKEYS]=0;
     prev_effort = computeLayoutEffort(prev_layout);    
+    double best_effort = prev_effort;
+    memcpy(best_layout, prev_layout, NUMKEYS+1);
+
+    int hands[NUMKEYS], rows[NUMKEYS];
+    for (int j=0; j<NUMKEYS; j++) {
+        hands[j] = keyInfoTable[j].hand;
+        rows[j] = keyInfoTable[j].row;
+    }
+    _proposals.init(curr_layout, layoutMask, hands, rows, _config);
+
+    uint64_t curr_hash = _cache.hash(curr_layout);
+    uint64_t prev_hash;
+    _cache.resetStats();
+    long window_lookups = 0;
+    long window_hits = 0;
+
+    _delta.reset(curr_layout);
+    if (_guided)
+        refreshGuideWeights(curr_layout);
+    vector<Proposal> moves;
+
+    // Truncated efforts can only be compared with each other, and are off
+    // by up to _tailbound, so they can misorder layouts.  The truncated best
+    // and the current layout are re-scored in full now and then, and at the
+    // end; the best of those by exact effort is the one kept.
+    bool truncated = _tailbound > 0.0;
+    char exact_layout[NUMKEYS+1];
+    double exact_effort = prev_effort;
+    memcpy(exact_layout, prev_layout, NUMKEYS+1);
+    auto rescore = [&](char *candidate) {
+        double effort = computeLayoutEffort(candidate);
+        if (effort < exact_effort) {
+            exact_effort = effort;
+            memcpy(exact_layout, candidate, NUMKEYS);
+        }
+        return effort;
+    };
+    if (truncated) {
+        prev_effort = best_effort = _delta.effort();
+        if (_verbose)
+            printf("truncated start: %.6f, exact %.6f\n", prev_effort, exact_effort);
+    }
+
+    bool screening = _screening;
+    double estimate = 0.0;
+    bool screened;
+    bool drawn;
+    int draw = 0;
+    long nscreened = 0;
+    long naudits = 0;
+    long nmissed = 0;
+    if (screening) {
+        _surrogate.reset(curr_layout);
+        calibrateSurrogate(curr_layout);
+        if (_verbose)
+            printf("surrogate: scale %.4f, error bound %.6f\n", _surrogate.scale(), _surrogate.error());
+    }
 
-    struct timespec ts0, ts1;
+    int moved[MAXMOVED];
+    int nmoved;
+    double ratio;
+    bool accept;
+    long naccepted = 0;
+    long nimproved = 0;
+
+    struct timespec ts0, ts1, start, now;
     clock_gettime(CLOCK_MONOTONIC, &ts0);
+    start = ts0;
+    double timetobest = 0.0;
 
+    // curr_layout always matches prev_layout at the top of the loop: it is
+    // changed by a proposal, and the proposal is undone if it is rejected
     do {
-        curr_effort = computeLayoutEffort(curr_layout);        
-        effortdelta = curr_effort - prev_effort;
+        prev_hash = curr_hash;
+        ratio = swapLayoutKeys(curr_layout, 1, 3, curr_hash, moves);
+        nmoved = movedKeys(moves, moved);
 
         t = t0 * exp((-1*((double)i)*k/(double)iterations));
-        p = p0 * exp(-1*fabs(effortdelta)/t);
-        if (p > 1.0) {
-            p = 1.0;
-        }
+        screened = false;
+        drawn = false;
+
+        // layouts are often revisited late in the schedule.  Moves are only
+        // scored here, and applied to _delta if accepted.
+        if (!_cache.lookup(curr_hash, curr_effort)) {
+            // A move that is surely worse is accepted only if the random
+            // draw beats its probability, and the draw is taken whatever its
+            // real effort, so take it now.  If it beats even the best case
+            // the surrogate allows, the move can be rejected unscored.
+            if (screening) {
+                estimate = _surrogate.tryKeys(curr_layout, moved, nmoved);
+                double lower = _surrogate.lowerBound(estimate);
+                double pmax = p0 * exp(-lower/t) * ratio;
+                if (lower > 0 && pmax < 1.0) {
+                    draw = _random.range(0, 10000);
+                    drawn = true;
+                    screened = !(pmax*10000 > draw);
+                }
+            }
 
-        // Always accept new layout if better than previous layout
-        if (effortdelta < 0) {
-            printLayoutTransition(i, prev_layout, curr_layout, prev_effort, curr_effort, p, t, true);
-            prev_effort = curr_effort;
-            memcpy(prev_layout, curr_layout, NUMKEYS);
+            if (!screened) {
+                curr_effort = _delta.tryKeys(curr_layout, moved, nmoved);
+                _cache.store(curr_hash, curr_effort);
+                if (screening)
+                    nmissed += !_surrogate.audit(estimate, curr_effort - _delta.effort());
+            } else if (++nscreened % SCREEN_AUDIT_INTERVAL == 0) {
+                naudits++;
+                nmissed += !_surrogate.audit(estimate, _delta.tryKeys(curr_layout, moved, nmoved) - _delta.effort());
+            }
+        }
 
-            // Sometimes accept new layout if worse than previous
+        if (screened) {
+            accept = false;
         } else {
-            if (p*10000 > random_range(0, 10000)) {
+            effortdelta = curr_effort - prev_effort;
+
+            p = p0 * exp(-1*fabs(effortdelta)/t);
+            if (p > 1.0) {
+                p = 1.0;
+            }
+
+            // Always accept new layout if better than previous layout, sometimes
+            // accept it if worse.  Moves that aren't symmetric have their
+            // acceptance scaled by the Hastings ratio to keep it fair.
+            double a = ((effortdelta < 0)? 1.0: p) * ratio;
+            accept = (a >= 1.0) || (a*10000 > (drawn? draw: _random.range(0, 10000)));
+        }
+
+        if (accept) {
+            if (_verbose)
                 printLayoutTransition(i, prev_layout, curr_layout, prev_effort, curr_effort, p, t, true);
-                prev_effort = curr_effort;
-                memcpy(prev_layout, curr_layout, NUMKEYS);
-            } else {
-                //printLayoutTransition(i, prev_layout, curr_layout, prev_effort, curr_effort, p, t, false);
+            _delta.updateKeys(curr_layout, moved, nmoved);
+            if (_guided)
+                updateGuideWeights(curr_layout, moved, nmoved);
+            if (screening)
+                _surrogate.updateKeys(curr_layout, moved, nmoved);
+            _delta.commit();
+            naccepted++;
+            nimproved += (effortdelta < 0);
+            prev_effort = curr_effort;
+            memcpy(prev_layout, curr_layout, NUMKEYS);
+            if (prev_effort < best_effort) {
+                best_effort = prev_effort;
+                memcpy(best_layout, prev_layout, NUMKEYS);
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                timetobest = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec)/1000000000.0;
             }
+        } else {
+            //printLayoutTransition(i, prev_layout, curr_layout, prev_effort, curr_effort, p, t, false);
+            for (size_t j=moves.size(); j-- > 0; )
+                _proposals.undo(curr_layout, moves[j]);
+            curr_hash = prev_hash;
         }
 
         if (iwindow++ == 32768) {  // print average layouts per/sec calculated
             clock_gettime(CLOCK_MONOTONIC, &ts1);
             double elapsed = (ts1.tv_sec - ts0.tv_sec) + (ts1.tv_nsec - ts0.tv_nsec)/1000000000.0;
-            printf("avg_layouts_per_sec: %.2f\n", iwindow/elapsed);
+            if (_verbose) {
+                printf("avg_layouts_per_sec: %.2f  cache_hit_rate: %.2f%%\n", iwindow/elapsed,
+                        100.0*(_cache.hits()-window_hits)/(_cache.lookups()-window_lookups));
+            }
+            window_lookups = _cache.lookups();
+            window_hits = _cache.hits();
+
+            // re-score from scratch now and then so rounding errors in the
+            // running total can't build up
+            _delta.reset(curr_layout);
+            if (_guided)
+                refreshGuideWeights(curr_layout);
+
+            if (truncated) {
+                double exact = rescore(best_layout);
+                rescore(prev_layout);
+                if (_verbose) {
+                    printf("exact_best: %.6f  truncated_best: %.6f (exact %.6f, +/- %.6f)\n",
+                            exact_effort, best_effort, exact, _tailbound);
+                }
+            }
+
             clock_gettime(CLOCK_MONOTONIC, &ts0);
             iwindow = 0;
         }
 
-        swapLayoutKeys(curr_layout, 1, 3, layoutMask);
+        // Publish our best layout to the other islands, and continue from
+        // theirs if it beats where we are now
+        if (_migration && i > 0 && i % _migrateinterval == 0) {
+            // other islands may not truncate alike, so only exact efforts
+            // are exchanged
+            if (truncated) {
+                rescore(best_layout);
+                _migration->publish(_island, exact_effort, exact_layout);
+            } else {
+                _migration->publish(_island, best_effort, best_layout);
+            }
+
+            // A migrant may come from an island with other constraints or
+            // another corpus, so it must be one this island could reach, and
+            // its published effort isn't trusted
+            char migrant[NUMKEYS+1];
+            double migrant_effort;
+            double current = truncated? rescore(prev_layout): prev_effort;
+            if (_migration->fetchBest(_island, migrant_effort, migrant) && _proposals.allows(migrant) &&
+                (migrant_effort = computeLayoutEffort(migrant)) < current) {
+                if (_verbose)
+                    printf("island %d: importing migrant %.6f (was %.6f)\n", _island, migrant_effort, current);
+                prev_effort = migrant_effort;
+                memcpy(prev_layout, migrant, NUMKEYS);
+                memcpy(curr_layout, migrant, NUMKEYS);
+                curr_hash = _cache.hash(curr_layout);
+                _proposals.reset(curr_layout);
+                _delta.reset(curr_layout);
+                _surrogate.reset(curr_layout);
+                if (_guided)
+                    refreshGuideWeights(curr_layout);
+                if (truncated) {
+                    rescore(prev_layout);
+                    prev_effort = _delta.effort();
+                }
+                if (prev_effort < best_effort) {
+                    best_effort = prev_effort;
+                    memcpy(best_layout, prev_layout, NUMKEYS);
+                }
+            }
+        }
     } while (++i < iterations);
 
+    if (truncated) {
+        if (_verbose)
+            printf("truncated final: %.6f (+/- %.6f)\n", prev_effort, _tailbound);
+        prev_effort = rescore(prev_layout);
+        rescore(best_layout);
+        best_effort = exact_effort;
+        memcpy(best_layout, exact_layout, NUMKEYS);
+        if (_verbose)
+            printf("exact_best: %.6f\n", best_effort);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    _stats.effort = prev_effort;
+    _stats.besteffort = best_effort;
+    memcpy(_stats.bestlayout, best_layout, NUMKEYS+1);
+    _stats.seconds = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec)/1000000000.0;
+    _stats.timetobest = timetobest;
+    _stats.accepted = naccepted;
+
+    if (_migration)
+        _migration->publish(_island, best_effort, best_layout);
+    if (!_verbose)
+        return prev_effort;
+
     printf("%3.6f = \"%s\"\n", prev_effort, prev_layout);
     printLayout(prev_layout);
+    printf("accepted: %ld of %d proposals, %ld of them improvements\n", naccepted, iterations, nimproved);
+    printf("eval_cache: %ld lookups, %ld hits (%.2f%%)\n",
+            _cache.lookups(), _cache.hits(), 100.0*_cache.hitRate());
+    if (screening) {
+        printf("screening: %ld of %d proposals rejected unscored (%.2f%%), %ld audited, %ld bound misses\n",
+                nscreened, iterations, 100.0*nscreened/iterations, naudits, nmissed);
+        printf("surrogate: scale %.4f, error bound %.6f\n", _surrogate.scale(), _surrogate.error());
+    }
 
     return prev_effort;
 }
 
 
-// parse a text file into 3-letter triads and calculate effort for each triad
+// Build a table, indexed by ascii value, of the characters that are
+// not part of the given corpus mode and should be skipped when parsing
+static void buildModeMap(uint8_t mode, bool *skip)
+{
+    for (int c=0; c<0x100; c++) {
+        skip[c] =
+            (c<0x20 || c>=0x7F)         ||
+            // 'c' is a letter but the LETTERS flag is not set
+            (!(mode & LETTERS) &&
+             ((c>=0x41 && c<=0x5A) ||       // uppercase letters
+              (c>=0x61 && c<=0x7A)))    ||  // lowercase letters
+
+            // 'c' is a number but the NUMBERS flag is not set
+            (!(mode & NUMBERS) &&
+             (c>=0x30 && c<=0x39))      ||  // 0-9
+
+            // 'c' is whitespace but the WHITESPACE flag is not set
+            (!(mode & WHITESPACE) &&
+             (c==0x20))                 ||  // space
+
+            // 'c' is a punctuation but the PUNCTUATION flag is not set
+            (!(mode & PUNCTUATION) &&
+             ((c>=0x21 && c<=0x22) ||       // ! "
+              (c>=0x27 && c<=0x29) ||       // ' ( )
+              (c>=0x2C && c<=0x2F) ||       // , - . /
+              (c>=0x3A && c<=0x3B) ||       // : ;
+              (c>=0x5B && c<=0x5D) ||       // [ \ ]
+              (c==0x3F ||                   // ?
+               c==0x5F ||                   // _
+               c==0x7B ||                   // {
+               c==0x7D)))               ||  // }
+
+            // 'c' is a symbol but the SYMBOL flag is not set
+            (!(mode & SYMBOLS) &&
+             ((c>=0x23 && c<=0x26) ||       // # $ % &
+              (c>=0x2A && c<=0x2B) ||       // * +
+              (c>=0x3C && c<=0x3E) ||       // < = >
+              (c==0x40 ||                   // @
+               c==0x5E ||                   // ^
+               c==0x60 ||                   // `
+               c==0x7C ||                   // |
+               c==0x7E)));                  // ~
+    }
+}
+
+
+// parse a text file into 3-letter triads and calculate effort for each triad.
+// The file may be plain text, or gzip/zstd compressed; compressed input is
+// decoded on a separate thread while the triads are counted here.
 bool KeyboardLayoutOptimizer::parseTriads(const string &file, uint8_t mode)
 {
-    FILE *fp = fopen(file.c_str(), "r");
-    if (!fp)
+    CorpusReader reader;
+    if (!reader.open(file))
         return false;
 
-    char buf[1024*32];
-    char *c1 = &buf[0];
-    char *c2 = &buf[1];
-    char *c3 = &buf[2];
+    bool skip[0x100];
+    buildModeMap(mode, skip);
 
+    vector<char> chunk;
     string triad(4, 0);
-    int batchsize;
-    char c;
 
-    while (!feof(fp) && (batchsize=fread(buf, 1, sizeof(buf), fp))) {
-        if (batchsize < 3)
-            break;
+    // the last two characters kept, carried from one chunk to the next so
+    // no triad is lost at a chunk boundary
+    uint8_t c1 = 0;
+    uint8_t c2 = 0;
+    int nkept = 0;
 
-        triad[0] = tolower(*c1);
-        triad[1] = tolower(*c2);
-        triad[2] = tolower(*c3);
-        //indexTriadEffort(triad);    
-        _triadmap[triad]++;
-        _triadcount++;
-        _digraphs[(int)triad[0]][(int)triad[1]]++;
-
-        for (int i=3; i<batchsize; i++) {
-            c1 = c2;
-            c2 = c3;
-            c3 = &buf[i];
-            c = *c3;
+    while (reader.next(chunk)) {
+        for (size_t i=0; i<chunk.size(); i++) {
+            uint8_t c = chunk[i];
 
             // Skip any characters that are not part of our mode
-            // TODO:  Should build a mode map, indexed by ascii to simply
-            //        lookup the mode(s) a given character falls under
-            while ((c<0x20 || c>=0x7F)         ||
-                   // 'c' is a letter but the LETTERS flag is not set
-                   (!(mode & LETTERS) &&
-                    ((c>=0x41 && c<=0x5A) ||       // uppercase letters
-                     (c>=0x61 && c<=0x7A)))    ||  // lowercase letters
-                     
-                   // 'c' is a number but the NUMBERS flag is not set
-                   (!(mode & NUMBERS) &&
-                    (c>=0x30 && c<=0x39))      ||  // 0-9
-
-                   // 'c' is whitespace but the WHITESPACE flag is not set
-                   (!(mode & WHITESPACE) &&
-                    (c==0x20))                 ||  // space
-
-                   // 'c' is a punctuation but the PUNCTUATION flag is not set
-                   (!(mode & PUNCTUATION) &&
-                    ((c>=0x21 && c<=0x22) ||       // ! "
-                     (c>=0x27 && c<=0x29) ||       // ' ( )
-                     (c>=0x2C && c<=0x2F) ||       // , - . /
-                     (c>=0x3A && c<=0x3B) ||       // : ;
-                     (c>=0x5B && c<=0x5D) ||       // [ \ ]
-                     (c==0x3F ||                   // ? 
-                      c==0x5F ||                   // _
-                      c==0x7B ||                   // {
-                      c==0x7D)))               ||  // }
-
-                   // 'c' is a symbol but the SYMBOL flag is not set
-                   (!(mode & SYMBOLS) &&            
-                    ((c>=0x23 && c<=0x26) ||       // # $ % &
-                     (c>=0x2A && c<=0x2B) ||       // * +
-                     (c>=0x3C && c<=0x3E) ||       // < = >
-                     (c==0x5E ||                   // ^
-                      c==0x60 ||                   // `
-                      c==0x7C ||                   // |
-                      c==0x7E))))                  // ~
-            {
-                if (i >= batchsize-1)
-                    return true;
-                c3 = &buf[++i];
-                c = *c3;
+            if (skip[c])
+                continue;
+            c = tolower(c);
+
+            if (nkept < 2) {
+                nkept++;
+            } else {
+                triad[0] = c1;
+                triad[1] = c2;
+                triad[2] = c;
+                //indexTriadEffort(triad);
+                _triadmap[triad]++;
+                _triadcount++;
+                _digraphs[c1][c2]++;
             }
-                            
-            triad[0] = tolower(*c1);
-            triad[1] = tolower(*c2);
-            triad[2] = tolower(*c3);
-            //indexTriadEffort(triad);
-            _triadmap[triad]++;
-            _triadcount++;
-            _digraphs[(int)triad[0]][(int)triad[1]]++;
-        }    
-    }
-
-    fclose(fp);
+            c1 = c2;
+            c2 = c;
+        }
+    }
+
+    buildTriadTable();
+    _cache.clear();
+    return !reader.failed();
+}
+
+
+// Write the parsed corpus tables to 'file', in the form mapTables() reads
+bool KeyboardLayoutOptimizer::saveTables(const string &file)
+{
+    TableHeader header;
+    memcpy(header.magic, "KLOTAB01", sizeof(header.magic));
+    header.triadcount = _triadcount;
+    header.ntriads = _ntriads;
+    for (int i=0; i<0x7F; i++)
+        memcpy(header.digraphs[i], _digraphs[i], sizeof(header.digraphs[i]));
+
+    // write to a temporary file and rename it into place, so a process
+    // mapping the same file never sees it half written
+    string tmp = file + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+        return false;
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(_triadtable, sizeof(TriadCount), _ntriads, fp) == _ntriads;
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(tmp.c_str(), file.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
     return true;
 }
 
 
+// Use the corpus tables in 'file' (see saveTables) through a read-only shared
+// mapping, instead of parsing a corpus.  Processes mapping the same file share
+// one copy of the tables.
+bool KeyboardLayoutOptimizer::mapTables(const string &file)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(TableHeader)) {
+        close(fd);
+        return false;
+    }
+
+    void *p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+
+    const TableHeader *header = (const TableHeader *)p;
+    if (memcmp(header->magic, "KLOTAB01", sizeof(header->magic)) != 0 ||
+        (size_t)st.st_size != sizeof(TableHeader) + header->ntriads*sizeof(TriadCount)) {
+        fprintf(stderr, "'%s' is not a corpus table file\n", file.c_str());
+        munmap(p, st.st_size);
+        return false;
+    }
+
+    if (_mapping)
+        munmap(_mapping, _mappingsize);
+    _mapping = p;
+    _mappingsize = st.st_size;
+
+    _triadmap.clear();
+    _triads.clear();
+    _triadtable = (const TriadCount *)(header+1);
+    _ntriads = header->ntriads;
+    _triadcount = header->triadcount;
+    for (int i=0; i<0x7F; i++)
+        memcpy(_digraphs[i], header->digraphs[i], sizeof(header->digraphs[i]));
+    initEvaluators();
+    _cache.clear();
+    return true;
+}
+
+
+// Exchange layouts with other islands through 'channel' every 'interval'
+// iterations of optimizeLayout.  Pass a null channel to run alone.
+void KeyboardLayoutOptimizer::setMigration(MigrationChannel *channel, int island, int interval)
+{
+    _migration = channel;
+    _island = island;
+    _migrateinterval = interval;
+}
+
+
 void KeyboardLayoutOptimizer::printTriads()
 {
     map<string, int>::iterator it;
@@ -460,143 +1048,456 @@ void KeyboardLayoutOptimizer::printTriads()
 
 void KeyboardLayoutOptimizer::showLayouts()
 { 
-    double qwerty_effort  = computeLayoutEffort(qwerty_layout);
-    double dvorak_effort  = computeLayoutEffort(dvorak_layout);
-    double colemak_effort = computeLayoutEffort(colemak_layout);
-    double workman_effort = computeLayoutEffort(workman_layout);
-    double bulpkm_effort  = computeLayoutEffort(bulpkm_layout);
-    double xfyl_effort    = computeLayoutEffort(xfyl_layout);
-    double test_effort    = computeLayoutEffort(test_layout);
-
     printf("Comparison: \n\n");
-    printf("%20s: %10.8f\n", "Qwerty",  qwerty_effort);
-    printf("%20s: %10.8f\n", "Dvorak",  dvorak_effort);
-    printf("%20s: %10.8f\n", "Colemak", colemak_effort);
-    printf("%20s: %10.8f\n", "Workman", workman_effort);
-    printf("%20s: %10.8f\n", "Bulpkm",  bulpkm_effort);
-    printf("%20s: %10.8f\n", "Xfyl",    xfyl_effort);
-    printf("%20s: %10.8f\n", "Test",    test_effort);
+    for (int i=0; i<NUMNAMEDLAYOUTS; i++)
+        printf("%20s: %10.8f\n", namedLayouts[i].name, computeLayoutEffort(namedLayouts[i].layout));
     printf("\n\n");
 }
 
 
+// A triad or digraph, and its count
 struct entry { 
-    string str;
+    char str[4];
     int count;
 };
 
-bool comp_entry(const entry &a, const entry &b) {
-    return (a.count > b.count); 
-}
+struct less_frequent {
+    bool operator()(const entry &a, const entry &b) const { return a.count < b.count; }
+};
 
 
-void KeyboardLayoutOptimizer::showTriads(int sortbyfreq)
+// Show the triads found at least 10 times; when sorted by frequency, only
+// the 'limit' most common (all of them if it is 0)
+void KeyboardLayoutOptimizer::showTriads(int sortbyfreq, int limit)
 {
     printf("\nTRIADS\n---------\n\n");
 
     // Don't sort anything
     if (!sortbyfreq) {
-        map<string, int>::iterator it;
-        for (it = _triadmap.begin(); it != _triadmap.end(); it++) {
-            if (it->second < 10)
+        for (size_t i=0; i<_ntriads; i++) {
+            const TriadCount &t = _triadtable[i];
+            if (t.count < 10)
                 continue;
-            printf("%6d: %s\n", it->second, it->first.c_str());
+            printf("%6d: %c%c%c\n", t.count, t.c[0], t.c[1], t.c[2]);
         }
 
     // Sort by most common
     } else {
-        list<entry> triadlist;
-        map<string, int>::iterator it;
-        for (it = _triadmap.begin(); it != _triadmap.end(); it++) {
-            if (it->second < 10)
+        TopK<entry, less_frequent> common(limit? limit: _ntriads);
+        for (size_t i=0; i<_ntriads; i++) {
+            const TriadCount &t = _triadtable[i];
+            if (t.count < 10)
                 continue;
-            
-            entry tx = {it->first, it->second};
-            triadlist.push_back(tx);
-        }    
-
-        triadlist.sort(comp_entry);    
-
-        list<entry>::iterator itr;
-        for (itr=triadlist.begin(); itr != triadlist.end(); itr++) {
-            printf("%6d: %s\n", itr->count, itr->str.c_str());
+            entry tx = { { (char)t.c[0], (char)t.c[1], (char)t.c[2], 0 }, t.count };
+            common.push(tx);
         }
+
+        vector<entry> triads;
+        common.take(triads);
+        for (size_t i=0; i<triads.size(); i++)
+            printf("%6d: %s\n", triads[i].count, triads[i].str);
     }
 }
 
 
-void KeyboardLayoutOptimizer::showDigraphs(int sortbyfreq)
+// Show the 'limit' most common digraphs, or all of them if it is 0
+void KeyboardLayoutOptimizer::showDigraphs(int sortbyfreq, int limit)
 {
     printf("\nDIGRAPHS\n---------\n\n");    
     
-    list<entry> digraphlist;
+    TopK<entry, less_frequent> common(limit? limit: 0x7F*0x7F);
     for (int i=0; i<0x7F; i++) {
         for (int j=0; j<0x7F; j++) {
             if (!_digraphs[i][j])
                 continue;
-            string s;
-            s += (char)i;
-            s += (char)j;
-            entry dx = {s, _digraphs[i][j]};
-            digraphlist.push_back(dx);
+            entry dx = { { (char)i, (char)j, 0 }, _digraphs[i][j] };
+            common.push(dx);
+        }
+    }
+
+    vector<entry> digraphs;
+    common.take(digraphs);
+    for (size_t i=0; i<digraphs.size(); i++) {
+        printf("%4d: %s\n", digraphs[i].count, digraphs[i].str);
+    }
+}
+
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options]\n"
+           "  -c, --corpus FILE   corpus to parse; plain text, gzip or zstd (default corpus/corpus.txt)\n"
+           "  -t, --tables FILE   map the parsed corpus tables from FILE, writing it first if needed\n"
+           "                      (or if -c is given, so the tables match that corpus)\n"
+           "  -s, --seed N        random seed (default: current time)\n"
+           "  -g, --guided        pick keys to swap by their share of the effort\n"
+           "      --screen        reject proposals unscored when a digraph estimate says they'll\n"
+           "                      be rejected anyway; faster, but the estimate's error bound is\n"
+           "                      only empirical, so results can differ from a full run\n"
+           "      --no-hugepages  don't ask for huge pages for the effort and digraph tables\n"
+           "      --coverage F    while optimizing, score only the most frequent triads making up\n"
+           "                      fraction F of the corpus (eg. 0.995); the best layout is re-scored exactly\n"
+           "  -v, --verify N      check the evaluators against the reference on N random cases, then exit\n"
+           "  -l, --layout KEYS   start from this %d key layout instead of qwerty\n"
+           "  -r, --report FILE   write a json report comparing the known layouts (and the -l one)\n"
+           "                      to FILE, or stdout if it is -, then exit\n"
+           "  -K, --top N         costliest triads to list per layout in the report (default 20)\n"
+           "\n"
+           "exact placement:\n"
+           "  -x, --exact KEYS    place KEYS optimally among their current positions, then exit\n"
+           "  -j, --threads N     threads for the exact search or a sweep (default: all cores)\n"
+           "\n"
+           "parameter sweep:\n"
+           "  -w, --sweep SPEC    run many annealing schedules at once, eg. \"t0=0.25,0.5 k=200:800:4 seed=1:4\";\n"
+           "                      parameters are t0, p0, k, iterations, rounds and seed\n"
+           "  -N, --samples N     draw N random configurations from SPEC instead of the full grid\n"
+           "  -o, --sweep-out FILE  write the results as csv, or json if FILE ends in .json (default sweep.csv)\n"
+           "\n"
+           "island model:\n"
+           "  -n, --islands N     fork N island processes that migrate layouts through shared memory\n"
+           "  -i, --island N      run as island N of a larger group\n"
+           "  -m, --migrate SPEC  exchange layouts through shm:NAME or tcp:HOST:PORT\n"
+           "      --migrate-interval N  iterations between migrations (default 10000)\n"
+           "      --hub PORT      serve tcp migration for islands on other hosts\n"
+           "  -h, --help          show this help\n",
+           prog, NUMKEYS);
+}
+
+
+// Fork 'nislands' copies of this process, each of which returns from here
+// as one island.  The parent waits for them all and reports the best layout
+// they found; it returns -1 in the children and an exit status in the parent.
+static int forkIslands(int nislands, const string &migrate, int &island)
+{
+    // opened before the islands start, as it ignores layouts published
+    // before it was opened
+    MigrationChannel *channel = MigrationChannel::create(migrate);
+
+    for (int n=0; n<nislands; n++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            break;
         }
+        if (pid == 0) {
+            delete channel;
+            island = n;
+            return -1;
+        }
+    }
+
+    int failed = 0;
+    int status;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
     }
 
-    digraphlist.sort(comp_entry);
-    list<entry>::iterator itr;
-    for (itr=digraphlist.begin(); itr != digraphlist.end(); itr++) {
-        printf("%4d: %s\n", itr->count, itr->str.c_str());
+    char layout[NUMKEYS+1];
+    double effort;
+    if (channel && channel->fetchBest(-1, effort, layout)) {
+        printf("\n\nBest Layout Found by %d islands: %f\n", nislands, effort);
+        printf("%3.6f = \"%s\"\n", effort, layout);
     }
+    delete channel;
+
+    return failed? 1: 0;
 }
 
 
 int main(int argc, char **argv)
 {
-    KeyboardLayoutOptimizer klo;
+    string corpus = "corpus/corpus.txt";
+    bool corpusgiven = false;
+    string tables;
+    string migrate;
+    unsigned int seed = time(0);
+    int verifycases = 0;
+    int nislands = 0;
+    int island = 0;
+    int migrateinterval = 10000;
+    int hubport = 0;
+    bool guided = false;
+    bool screening = false;
+    double coverage = 1.0;
+    string exact;
+    int threads = thread::hardware_concurrency();
+    char *layout = qwerty_layout;
+    string sweep;
+    string sweepout = "sweep.csv";
+    int samples = 0;
+    string report;
+    int topk = 20;
+
+    // annealing schedule
+    int rounds = 1;
+    int iterations = 1000000;
+    double t0=0.5;
+    double p0=0.3;   /* Set to zero to refuse transitions to worse layouts */
+    double k =500.0; /* set higher to cooldown faster */
+
+    static struct option options[] = {
+        { "corpus",           required_argument, 0, 'c' },
+        { "tables",           required_argument, 0, 't' },
+        { "seed",             required_argument, 0, 's' },
+        { "verify",           required_argument, 0, 'v' },
+        { "layout",           required_argument, 0, 'l' },
+        { "report",           required_argument, 0, 'r' },
+        { "top",              required_argument, 0, 'K' },
+        { "exact",            required_argument, 0, 'x' },
+        { "threads",          required_argument, 0, 'j' },
+        { "sweep",            required_argument, 0, 'w' },
+        { "samples",          required_argument, 0, 'N' },
+        { "sweep-out",        required_argument, 0, 'o' },
+        { "guided",           no_argument,       0, 'g' },
+        { "screen",           no_argument,       0, 'E' },
+        { "no-screen",        no_argument,       0, 'S' },
+        { "no-hugepages",     no_argument,       0, 'P' },
+        { "coverage",         required_argument, 0, 'C' },
+        { "islands",          required_argument, 0, 'n' },
+        { "island",           required_argument, 0, 'i' },
+        { "migrate",          required_argument, 0, 'm' },
+        { "migrate-interval", required_argument, 0, 'I' },
+        { "hub",              required_argument, 0, 'H' },
+        { "help",             no_argument,       0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:t:s:v:l:r:K:x:j:w:N:o:gn:i:m:h", options, 0)) != -1) {
+        switch (opt) {
+        case 'c':
+            corpus = optarg;
+            corpusgiven = true;
+            break;
+        case 't':
+            tables = optarg;
+            break;
+        case 's':
+            seed = strtoul(optarg, 0, 10);
+            break;
+        case 'v':
+            verifycases = atoi(optarg);
+            break;
+        case 'l':
+            if (strlen(optarg) != NUMKEYS) {
+                fprintf(stderr, "A layout must have %d keys\n", NUMKEYS);
+                return 1;
+            }
+            layout = optarg;
+            break;
+        case 'r':
+            report = optarg;
+            break;
+        case 'K': {
+            char *end;
+            long n = strtol(optarg, &end, 10);
+            if (*optarg == 0 || *end || n < 0 || n > INT_MAX) {
+                fprintf(stderr, "--top must be a number of triads, 0 or more\n");
+                return 1;
+            }
+            topk = n;
+            break;
+        }
+        case 'x':
+            exact = optarg;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'w':
+            sweep = optarg;
+            break;
+        case 'N':
+            samples = atoi(optarg);
+            break;
+        case 'o':
+            sweepout = optarg;
+            break;
+        case 'g':
+            guided = true;
+            break;
+        case 'E':
+            screening = true;
+            break;
+        case 'S':
+            screening = false;
+            break;
+        case 'P':
+            TableArena::setHugePages(false);
+            break;
+        case 'C':
+            coverage = atof(optarg);
+            break;
+        case 'n':
+            nislands = atoi(optarg);
+            if (nislands < 0 || nislands > MAXISLANDS) {
+                fprintf(stderr, "There can be at most %d islands\n", MAXISLANDS);
+                return 1;
+            }
+            break;
+        case 'i':
+            island = atoi(optarg);
+            if (island < 0 || island >= MAXISLANDS) {
+                fprintf(stderr, "An island number must be from 0 to %d\n", MAXISLANDS-1);
+                return 1;
+            }
+            break;
+        case 'm':
+            migrate = optarg;
+            break;
+        case 'I':
+            migrateinterval = atoi(optarg);
+            if (migrateinterval < 1) {
+                fprintf(stderr, "The migration interval must be at least 1 iteration\n");
+                return 1;
+            }
+            break;
+        case 'H':
+            hubport = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (hubport)
+        return runMigrationHub(hubport);
+
+    // forked islands share a segment and table file named after the parent
+    bool ownsegment = false;
+    bool owntables = false;
+    if (nislands > 1) {
+        char name[64];
+        if (migrate.empty()) {
+            snprintf(name, sizeof(name), "shm:klo-%d", (int)getpid());
+            migrate = name;
+            ownsegment = true;
+        }
+        if (tables.empty()) {
+            snprintf(name, sizeof(name), "/dev/shm/klo-tables-%d", (int)getpid());
+            tables = name;
+            owntables = true;
+        }
+    }
 
-    //if (!klo.initPathCost("conf/pathcost.conf")) {
+    KeyboardLayoutOptimizer *klo = new KeyboardLayoutOptimizer;
+
+    //if (!klo->initPathCost("conf/pathcost.conf")) {
     //    printf("Unable to load conf/pathcost.conf\n");
     //    return 0;
     //}
 
     // This is needed for parseTriads()
-    klo.buildCharToIndexMap(qwerty_layout);
+    klo->buildCharToIndexMap(qwerty_layout);
+
+    // a table file written from another corpus mustn't stand in for -c, and
+    // the reference effort of --verify counts the triads parsed into _triadmap
+    if (tables.empty() || corpusgiven || verifycases > 0 || !klo->mapTables(tables)) {
+        if (!klo->parseTriads(corpus, LETTERS /*| NUMBERS | PUNCTUATION | SYMBOLS*/)) {
+            fprintf(stderr, "Error parsing triads from '%s'\n", corpus.c_str());
+            delete klo;
+            return 1;
+        }
+
+        if (!tables.empty() && !verifycases) {
+            if (!klo->saveTables(tables) || !klo->mapTables(tables))
+                fprintf(stderr, "Unable to share corpus tables through '%s'\n", tables.c_str());
+        }
+    }
+
+    if (verifycases > 0) {
+        klo->setCoverage(coverage);
+        return klo->verifyEvaluators(verifycases, 8, seed)? 0: 1;
+    }
+
+    if (!report.empty()) {
+        vector<pair<string, string> > layouts;
+        for (int i=0; i<NUMNAMEDLAYOUTS; i++)
+            layouts.push_back(make_pair(string(namedLayouts[i].name), string(namedLayouts[i].layout)));
+        if (layout != qwerty_layout)
+            layouts.push_back(make_pair(string("Layout"), string(layout)));
+        return klo->writeReport(layouts, topk, report)? 0: 1;
+    }
+
+    if (!exact.empty())
+        return klo->solveExact(layout, exact, threads)? 0: 1;
+
+    if (!sweep.empty()) {
+        klo->setGuidedProposals(guided);
+        klo->setScreening(screening);
+        klo->setCoverage(coverage);
+
+        SweepConfig base = { t0, p0, k, iterations, rounds, seed };
+        vector<SweepConfig> configs;
+        if (!parseSweep(sweep, samples, seed, base, configs))
+            return 1;
+        return runSweep(klo, configs, layout, threads, sweepout)? 0: 1;
+    }
+
+    if (nislands > 1) {
+        int status = forkIslands(nislands, migrate, island);
+        if (status >= 0) {
+            if (ownsegment)
+                shm_unlink(migrate.c_str()+4);
+            if (owntables)
+                unlink(tables.c_str());
+            delete klo;
+            return status;
+        }
+    }
 
-    if (!klo.parseTriads("corpus/corpus.txt", LETTERS /*| NUMBERS | PUNCTUATION | SYMBOLS*/)) {
-        fprintf(stderr, "Error parsing triads from '%s'\n", "corpus/corpus.txt");
-        //exit(1);
+    klo->setSeed(seed + island);
+    klo->setGuidedProposals(guided);
+    klo->setScreening(screening);
+    klo->setCoverage(coverage);
+
+    MigrationChannel *channel = 0;
+    if (!migrate.empty()) {
+        channel = MigrationChannel::create(migrate);
+        if (!channel)
+            return 1;
+        klo->setMigration(channel, island, migrateinterval);
     }
 
-    //klo.showTriads(1);
+    //klo->showTriads(1);
 #if 1
-    klo.showLayouts();
+    klo->showLayouts();
     //show_triads(1);
     //show_digraphs(1);
         
     printf("Optimizing Layout\n");
-    int rounds = 1;
-    int iterations = 1000000;
     struct timeval start, end;
     float best=100.0, curr;
-    char *layout = qwerty_layout;
-    double t0=0.5;
-    double p0=0.3;   /* Set to zero to refuse transitions to worse layouts */
-    double k =500.0; /* set higher to cooldown faster */
+    TlbCounter tlb;
 
     gettimeofday(&start, NULL);
+    tlb.start();
 
     for (int i=0; i<rounds; i++) {
-        curr = klo.optimizeLayout(layout, iterations, t0, p0, k);
+        curr = klo->optimizeLayout(layout, iterations, t0, p0, k);
         if (curr < best)
             best = curr;
     }
 
+    uint64_t tlbmisses = tlb.stop();
     gettimeofday(&end, NULL);
     int elapsed = end.tv_sec - start.tv_sec;
     printf("\n\nRounds: %d of %d iterations\n", rounds, iterations);
     printf("Elapsed time: %d seconds (%d layouts per second)\n", elapsed, iterations/elapsed); 
+    printf("Tables: %s pages\n", klo->hugeTables()? "huge": "normal");
+    if (tlb.available())
+        printf("dTLB misses: %llu (%.2f per layout)\n", (unsigned long long)tlbmisses, (double)tlbmisses/((double)iterations*rounds));
+    else
+        printf("dTLB misses: unavailable\n");
     printf("Best Layout Found: %f\n\n", best);
 #endif
+    delete channel;
+    delete klo;
     return 0;    
 }
 
@@ -4,7 +4,14 @@
 #include <stdint.h>
 #include <string>
 #include <map>
+#include <vector>
 #include "configuration.h"
+#include "proposalgenerator.h"
+#include "evalcache.h"
+#include "island.h"
+#include "deltaevaluator.h"
+#include "surrogate.h"
+#include "arena.h"
 
 using namespace std;
 
@@ -44,6 +51,16 @@ enum FingerType {
 };
 
 
+// which hand, row and finger a key index corresponds to
+struct KeyInfo {
+    HandType hand;
+    RowType row;
+    FingerType finger;
+};
+
+extern KeyInfo keyInfoTable[NUMKEYS];
+
+
 /* Weigh different parameters differently:
 kb:  Base Weight     (Finger travel distance to type something)
 kp:  Pentalty Weight (Key sequence to type something)
@@ -68,35 +85,122 @@ const double k3 = 0.235;
 //                                        0.0, 0.0, 0.0, 0.5, 1.0 };  //   Rthumb, Rindex, Rmid, Rring, Rpinky }
 
 
+// a triad of characters and the number of times it occurs in the corpus
+struct TriadCount {
+    uint8_t c[3];
+    int count;
+};
+
+// Header of a corpus table file written by saveTables().  It is followed
+// by 'ntriads' TriadCount entries.
+struct TableHeader {
+    char magic[8];
+    int32_t triadcount;
+    int32_t ntriads;
+    int32_t digraphs[0x7F][0x7F];
+};
+
+// Guided proposals give every key at least this fraction of the average
+// key's share of the effort, so no movable key is starved
+const double GUIDED_FLOOR = 0.1;
+
+// relative tolerance allowed between the reference and any faster evaluator
+const double VERIFY_TOLERANCE = 1e-9;
+
+// --verify checks truncated evaluation at this coverage, unless another was set
+const double VERIFY_COVERAGE = 0.95;
+
+// Screening: the surrogate is calibrated on this many random moves, its
+// error bound is widened by this factor over the worst error seen, and one
+// in this many screened out moves is scored anyway to check the bound
+const int SCREEN_SAMPLES = 2000;
+const double SCREEN_MARGIN = 1.5;
+const int SCREEN_AUDIT_INTERVAL = 64;
+
+
+// What the last call of optimizeLayout() did
+struct OptimizeStats {
+    double effort;                  // of the final layout
+    double besteffort;
+    char bestlayout[NUMKEYS+1];
+    double seconds;
+    double timetobest;              // seconds until the best layout was first reached
+    long accepted;
+};
+
+
+struct LayoutReport;
+
+
 class KeyboardLayoutOptimizer
 {
 public:
     KeyboardLayoutOptimizer();
     ~KeyboardLayoutOptimizer();
 
+    // Another optimizer on the same corpus and effort tables, with its own
+    // layout, random numbers and caches.  It runs independently of this
+    // one, which must outlive it.
+    KeyboardLayoutOptimizer *spawn() const;
+
     double optimizeLayout(char *layout, int iterations, double t0, double p0, double k);
+    const OptimizeStats &lastStats() const { return _stats; }
+
+    // whether the effort and digraph tables are on huge pages
+    bool hugeTables() const { return _arena->hugePages(); }
+    const EvalCache &evalCache() const { return _cache; }
+    void clearCache() { _cache.clear(); }
     void printLayoutTransition(int iteration, char *oldlayout, char *newlayout, double oldeffort, double neweffort, double p, double t, bool accept);
     void printLayout(char *layout);
     void printLayoutsSideBySide(char *layout1, char *layout2);
     void showLayouts();
-    void showTriads(int sortbyfreq);
-    void showDigraphs(int sortbyfreq);
+    void showTriads(int sortbyfreq, int limit = 0);
+    void showDigraphs(int sortbyfreq, int limit = 0);
+    bool writeReport(const vector<pair<string, string> > &layouts, int topk, const string &file);
     void buildCharToIndexMap(char *layout);
     bool parseTriads(const string &file, uint8_t mode);
+    bool saveTables(const string &file);
+    bool mapTables(const string &file);
+    void setMigration(MigrationChannel *channel, int island, int interval);
+    void setGuidedProposals(bool guided) { _guided = guided; }
+    void setScreening(bool screening) { _screening = screening; }
+    void setCoverage(double fraction);
+    void setSeed(unsigned int seed) { _random.setSeed(seed); }
+    void setVerbose(bool verbose) { _verbose = verbose; }
+    bool verifyEvaluators(int cases, int maxswaps, unsigned int seed);
+    bool solveExact(char *layout, const string &keys, int threads);
 
 private:
+    KeyboardLayoutOptimizer(const KeyboardLayoutOptimizer *shared);
+    void initState();
     double getTriadEffort(int ikey1, int ikey2, int ikey3);
     double getTriadEffort(const string &triad);
     double computeTriadEffort(int ikey1, int ikey2, int ikey3);
     double computeLayoutEffort(char *layout);
-    void swapLayoutKeys(char *layout, int minswaps, int maxswaps, uint8_t *mask);
+    double referenceTriadEffort(int ikey1, int ikey2, int ikey3);
+    double referenceLayoutEffort(const char *layout);
+    void buildTriadTable();
+    void initEvaluators();
+    bool verifyCase(const char *layout, const vector<pair<int,int> > &swaps, bool report);
+    double swapLayoutKeys(char *layout, int minswaps, int maxswaps, uint64_t &hash, vector<Proposal> &moves);
+    int movedKeys(const vector<Proposal> &moves, int *keys);
+    void proposalWeights(const char *layout, double *weights);
+    void refreshGuideWeights(const char *layout);
+    void updateGuideWeights(const char *layout, const int *keys, int nkeys);
+    void calibrateSurrogate(const char *layout);
+    void reportLayout(const char *layout, int topk, LayoutReport &report);
     void printTriads();
 
 private:
     char _layout[NUMKEYS+1];
     
-    // stores the cost of typing any 3 keys in succession for a given layout
-    double  _triadeffort[NUMKEYS][NUMKEYS][NUMKEYS];
+    // the read-only tables, shared with the optimizers spawned from this one
+    // (which use a copy on their own NUMA node)
+    TableArena *_arena;
+    bool _ownsarena;
+
+    // stores the cost of typing any 3 keys in succession for a given layout.
+    double (*_triadeffort)[NUMKEYS][KEYSTRIDE];
 
     // tells the optimizer which keys it's allowed to move when optimizing
     uint8_t _layoutmask[NUMKEYS];
@@ -110,13 +214,63 @@ private:
     // map of all triads to their frequency as found in the corpus
     map<string, int> _triadmap;
 
+    // flattened copy of _triadmap, in the same order
+    vector<TriadCount> _triads;
+
+    // the triads used for evaluation: either _triads, or a read-only
+    // mapping of a table file shared with other processes
+    const TriadCount *_triadtable;
+    size_t _ntriads;
+    void *_mapping;
+    size_t _mappingsize;
+
     // total number of triads found in the corpus (not unique)
     int _triadcount;
 
-    // frequency of all digraphs found in the corpus
-    int _digraphs[0x7F][0x7F];
+    // frequency of all digraphs found in the corpus, in _arena
+    int (*_digraphs)[0x80];
 
     Configuration _config;
+
+    // this optimizer's random numbers, and the random key swaps drawn from
+    // them for optimizeLayout
+    Random _random;
+    ProposalGenerator _proposals;
+
+    // efforts of recently evaluated layouts, by Zobrist hash
+    EvalCache _cache;
+
+    // incremental effort of the layout being optimized, with per-key shares
+    DeltaEvaluator _delta;
+
+    // Truncated evaluation: _delta scores only the most frequent triads,
+    // covering this fraction of the corpus, and its efforts are within
+    // _tailbound of the real ones.  The triads left out are counted as
+    // _tailoffset.
+    double _coverage;
+    vector<TriadCount> _head;
+    double _tailbound;
+    double _tailoffset;
+
+    // digraph estimate used to skip scoring moves that will likely be
+    // rejected (off by default, as it can change the result)
+    SurrogateEvaluator _surrogate;
+    bool _screening;
+
+    // pick keys to swap in proportion to their share of the effort, by
+    // weights per character
+    bool _guided;
+    double _guideweights[0x100];
+    double _guidefloor;
+
+    // print progress while optimizing
+    bool _verbose;
+    OptimizeStats _stats;
+
+    // island model: where to exchange layouts with other processes, and how often
+    MigrationChannel *_migration;
+    int _island;
+    int _migrateinterval;
 };
 
 
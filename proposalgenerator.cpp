@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proposalgenerator.h"
+
+using namespace std;
+
+
+// n'th element of the (disjoint) union of two sets
+static inline int element(const IndexSet &a, const IndexSet &b, int n)
+{
+    return (n < a.size())? a[n]: b[n-a.size()];
+}
+
+
+ProposalGenerator::ProposalGenerator(Random *random)
+    : _random(random)
+{
+    memset(_hand, 0, sizeof(_hand));
+    memset(_movable, 0, sizeof(_movable));
+    memset(_slotok, 0, sizeof(_slotok));
+    memset(_locked, 0, sizeof(_locked));
+    memset(_paired, 0, sizeof(_paired));
+    memset(_pos, 0, sizeof(_pos));
+    memset(_start, 0, sizeof(_start));
+}
+
+
+ProposalGenerator::ProposalGenerator(const ProposalGenerator &other, Random *random)
+    : ProposalGenerator(other)
+{
+    _random = random;
+}
+
+
+// Set up the constraints for 'layout'.  hands[] and rows[] give the hand and
+// row of each key index.
+void ProposalGenerator::init(const char *layout, const uint8_t *mask, const int *hands, const int *rows, const Configuration &config)
+{
+    bool pinned[0x100];
+    memset(pinned, 0, sizeof(pinned));
+    memset(_locked, 0, sizeof(_locked));
+    memset(_paired, 0, sizeof(_paired));
+    _pairs.clear();
+    memcpy(_start, layout, NUMKEYS);
+
+    const string &pinnedkeys = config.pinnedKeys();
+    for (size_t i=0; i<pinnedkeys.length(); i++)
+        pinned[(uint8_t)pinnedkeys[i]] = true;
+
+    const string &onehandkeys = config.oneHandKeys();
+    for (size_t i=0; i<onehandkeys.length(); i++)
+        _locked[(uint8_t)onehandkeys[i]] = true;
+
+    for (int i=0; i<NUMKEYS; i++) {
+        _hand[i] = hands[i];
+        _movable[i] = mask[i] && !pinned[(uint8_t)layout[i]];
+    }
+
+    const vector<string> &pairs = config.keyPairs();
+    for (size_t i=0; i<pairs.size(); i++) {
+        const char *left = strchr(layout, pairs[i][0]);
+        const char *right = strchr(layout, pairs[i][1]);
+        if (!left || !right || right != left+1 ||
+            rows[left-layout] != rows[right-layout] || hands[left-layout] != hands[right-layout]) {
+            printf("Warning, pair '%s' is not side by side on one hand, ignoring\n", pairs[i].c_str());
+            continue;
+        }
+
+        _paired[(uint8_t)pairs[i][0]] = true;
+        _paired[(uint8_t)pairs[i][1]] = true;
+
+        // a pair with either key masked out stays where it is
+        if (_movable[left-layout] && _movable[right-layout])
+            _pairs.push_back(pairs[i]);
+    }
+
+    for (int i=0; i<NUMKEYS; i++) {
+        _slotok[i] = (i+1 < NUMKEYS) &&
+                     _movable[i] && _movable[i+1] &&
+                     rows[i] == rows[i+1] && hands[i] == hands[i+1];
+    }
+
+    reset(layout);
+}
+
+
+// Rebuild the candidate sets for a new layout
+void ProposalGenerator::reset(const char *layout)
+{
+    for (int h=0; h<2; h++) {
+        _singles[h].clear();
+        _unlocked[h].clear();
+        _slots[h].clear();
+        _unlockedslots[h].clear();
+    }
+
+    for (int i=0; i<NUMKEYS; i++) {
+        _pos[(uint8_t)layout[i]] = i;
+        update(layout, i);
+        updateSlot(layout, i);
+    }
+}
+
+
+// Refresh the single key sets after 'key' changed
+void ProposalGenerator::update(const char *layout, int key)
+{
+    uint8_t c = layout[key];
+    int h = _hand[key];
+
+    if (_movable[key] && !_paired[c]) {
+        _singles[h].insert(key);
+        if (_locked[c])
+            _unlocked[h].erase(key);
+        else
+            _unlocked[h].insert(key);
+    } else {
+        _singles[h].erase(key);
+        _unlocked[h].erase(key);
+    }
+}
+
+
+// Refresh the sets holding the pair slot made of keys 'slot' and 'slot+1'
+void ProposalGenerator::updateSlot(const char *layout, int slot)
+{
+    if (slot < 0 || !_slotok[slot])
+        return;
+
+    uint8_t c1 = layout[slot];
+    uint8_t c2 = layout[slot+1];
+    int h = _hand[slot];
+
+    if (!_paired[c1] && !_paired[c2]) {
+        _slots[h].insert(slot);
+        if (_locked[c1] || _locked[c2])
+            _unlockedslots[h].erase(slot);
+        else
+            _unlockedslots[h].insert(slot);
+    } else {
+        _slots[h].erase(slot);
+        _unlockedslots[h].erase(slot);
+    }
+}
+
+
+void ProposalGenerator::swapKeys(char *layout, int key1, int key2)
+{
+    char hold = layout[key1];
+    layout[key1] = layout[key2];
+    layout[key2] = hold;
+
+    _pos[(uint8_t)layout[key1]] = key1;
+    _pos[(uint8_t)layout[key2]] = key2;
+
+    update(layout, key1);
+    update(layout, key2);
+    updateSlot(layout, key1-1);
+    updateSlot(layout, key1);
+    updateSlot(layout, key2-1);
+    updateSlot(layout, key2);
+}
+
+
+// Number of keys that 'key' may swap with, counting itself
+int ProposalGenerator::partners(const char *layout, int key) const
+{
+    int h = _hand[key];
+    // same hand: any single; other hand: only if neither key is locked
+    return _singles[h].size() + (_locked[(uint8_t)layout[key]]? 0: _unlocked[!h].size());
+}
+
+
+// Pick a movable single key with probability proportional to its weight
+int ProposalGenerator::pickWeighted(const double *weights) const
+{
+    double total = 0.0;
+    for (int h=0; h<2; h++) {
+        for (int i=0; i<_singles[h].size(); i++)
+            total += weights[_singles[h][i]];
+    }
+
+    double r = total*_random->uniform();
+    int key = _singles[0].size()? _singles[0][0]: _singles[1][0];
+    for (int h=0; h<2; h++) {
+        for (int i=0; i<_singles[h].size(); i++) {
+            key = _singles[h][i];
+            r -= weights[key];
+            if (r < 0.0)
+                return key;
+        }
+    }
+    return key;
+}
+
+
+// Pick a random valid move and apply it to 'layout'.  Each movable single key
+// and each movable pair is equally likely to be chosen (or single keys are
+// chosen by weight, if 'weights' is given), then its partner is drawn
+// uniformly from the places it may legally go.  If 'forward' is given it is
+// set to the move's probability().  Returns false if no move is possible.
+bool ProposalGenerator::propose(char *layout, Proposal &move, const double *weights, double *forward)
+{
+    int nsingles = _singles[0].size() + _singles[1].size();
+    int npairs = _pairs.size();
+    if (nsingles + npairs == 0)
+        return false;
+
+    int r = _random->index(nsingles + npairs);
+
+    if (r < nsingles) {
+        int key1 = weights? pickWeighted(weights): element(_singles[0], _singles[1], r);
+        int h = _hand[key1];
+
+        const IndexSet &other = _unlocked[!h];
+        int n = partners(layout, key1);
+        if (n < 2)
+            return false;
+
+        // uniform over the n-1 candidates other than key1 itself
+        int key2 = element(_singles[h], other, _random->index(n-1));
+        if (key2 == key1)
+            key2 = element(_singles[h], other, n-1);
+
+        move.nswaps = 1;
+        move.key1[0] = key1;
+        move.key2[0] = key2;
+
+    } else {
+        const string &pair = _pairs[r-nsingles];
+        int left = _pos[(uint8_t)pair[0]];
+        int h = _hand[left];
+        bool locked = _locked[(uint8_t)pair[0]] || _locked[(uint8_t)pair[1]];
+
+        const IndexSet &other = _unlockedslots[!h];
+        int n = _slots[h].size() + (locked? 0: other.size());
+        if (n == 0)
+            return false;
+
+        int slot = element(_slots[h], other, _random->index(n));
+
+        move.nswaps = 2;
+        move.key1[0] = left;
+        move.key2[0] = slot;
+        move.key1[1] = left+1;
+        move.key2[1] = slot+1;
+    }
+
+    if (forward)
+        *forward = probability(layout, move, weights);
+
+    for (int i=0; i<move.nswaps; i++)
+        swapKeys(layout, move.key1[i], move.key2[i]);
+
+    return true;
+}
+
+
+double ProposalGenerator::probability(const char *layout, const Proposal &move, const double *weights) const
+{
+    int nsingles = _singles[0].size() + _singles[1].size();
+    int units = nsingles + _pairs.size();
+
+    if (move.nswaps == 2) {
+        // pair at key1[0] moving to the slot at key2[0]
+        uint8_t c1 = layout[move.key1[0]];
+        uint8_t c2 = layout[move.key1[1]];
+        int h = _hand[move.key1[0]];
+        bool locked = _locked[c1] || _locked[c2];
+        int n = _slots[h].size() + (locked? 0: _unlockedslots[!h].size());
+        return 1.0 / units / n;
+    }
+
+    // either key may have been the one picked first
+    int keys[2] = { move.key1[0], move.key2[0] };
+    double total = nsingles;
+    if (weights) {
+        total = 0.0;
+        for (int h=0; h<2; h++) {
+            for (int i=0; i<_singles[h].size(); i++)
+                total += weights[_singles[h][i]];
+        }
+    }
+
+    double p = 0.0;
+    for (int i=0; i<2; i++) {
+        double first = (weights? weights[keys[i]]: 1.0) / total;
+        p += first / (partners(layout, keys[i]) - 1);
+    }
+    return p * nsingles / units;
+}
+
+
+bool ProposalGenerator::allows(const char *layout) const
+{
+    // the same characters, with every key that can't move left in place
+    int counts[0x100] = { 0 };
+    int pos[0x100];
+    for (int i=0; i<NUMKEYS; i++) {
+        if (!_movable[i] && layout[i] != _start[i])
+            return false;
+        counts[(uint8_t)_start[i]]++;
+        counts[(uint8_t)layout[i]]--;
+        pos[(uint8_t)layout[i]] = i;
+    }
+
+    for (int i=0; i<NUMKEYS; i++) {
+        uint8_t c = _start[i];
+        if (counts[c] != 0)
+            return false;
+        // keys locked to a hand are still on it
+        if (_locked[c] && _hand[pos[c]] != _hand[i])
+            return false;
+    }
+
+    // pairs are still side by side, in a slot they may move to
+    for (size_t i=0; i<_pairs.size(); i++) {
+        int left = pos[(uint8_t)_pairs[i][0]];
+        if (!_slotok[left] || pos[(uint8_t)_pairs[i][1]] != left+1)
+            return false;
+    }
+    return true;
+}
+
+
+// Revert a move made by propose()
+void ProposalGenerator::undo(char *layout, const Proposal &move)
+{
+    for (int i=move.nswaps-1; i>=0; i--)
+        swapKeys(layout, move.key1[i], move.key2[i]);
+}
@@ -0,0 +1,121 @@
+#ifndef PROPOSALGENERATOR_H
+#define PROPOSALGENERATOR_H
+
+#include <stdint.h>
+#include <vector>
+#include "configuration.h"
+#include "rng.h"
+
+
+// A set of key indices with O(1) insert, erase, lookup and indexing
+class IndexSet
+{
+public:
+    IndexSet() { clear(); }
+
+    void clear()
+    {
+        _size = 0;
+        for (int i=0; i<NUMKEYS; i++)
+            _slot[i] = -1;
+    }
+
+    void insert(int i)
+    {
+        if (_slot[i] >= 0)
+            return;
+        _slot[i] = _size;
+        _items[_size++] = i;
+    }
+
+    void erase(int i)
+    {
+        if (_slot[i] < 0)
+            return;
+        int last = _items[--_size];
+        _items[_slot[i]] = last;
+        _slot[last] = _slot[i];
+        _slot[i] = -1;
+    }
+
+    bool contains(int i) const { return _slot[i] >= 0; }
+    int size() const { return _size; }
+    int operator[](int n) const { return _items[n]; }
+
+private:
+    int _items[NUMKEYS];
+    int _slot[NUMKEYS];   // position of each index within _items, or -1
+    int _size;
+};
+
+
+// A move: one or two key swaps applied together
+struct Proposal {
+    int nswaps;
+    int key1[2];
+    int key2[2];
+};
+
+
+/* Generates random key swaps that respect layoutMask and the constraints in
+   Configuration (pinned keys, keys locked to one hand, adjacent pairs).
+
+   The generator tracks which positions are valid swap candidates as the
+   layout changes, so every move is drawn directly from a valid set in O(1)
+   instead of drawing random keys until one is acceptable.
+
+   Optionally the first key of a single key swap is drawn in proportion to a
+   per-key weight (eg. its share of the effort) rather than uniformly; that
+   costs a scan of the movable keys.  probability() gives the chance of any
+   move, for the Hastings correction of the acceptance test.  The layout must
+   only be changed through propose() and undo() between calls to reset().
+   Random numbers come from the stream given to the constructor. */
+class ProposalGenerator
+{
+public:
+    ProposalGenerator(Random *random);
+
+    // A copy of 'other', in the same state, drawing from 'random' instead
+    ProposalGenerator(const ProposalGenerator &other, Random *random);
+
+    void init(const char *layout, const uint8_t *mask, const int *hands, const int *rows, const Configuration &config);
+    void reset(const char *layout);
+
+    bool propose(char *layout, Proposal &move, const double *weights=0, double *forward=0);
+    void undo(char *layout, const Proposal &move);
+
+    // Probability that propose() picks 'move' from the current layout
+    double probability(const char *layout, const Proposal &move, const double *weights=0) const;
+
+    // Whether 'layout' keeps the constraints of the layout given to init(),
+    // ie. it could have been reached from there by propose()
+    bool allows(const char *layout) const;
+
+private:
+    void swapKeys(char *layout, int key1, int key2);
+    void update(const char *layout, int key);
+    void updateSlot(const char *layout, int slot);
+    int partners(const char *layout, int key) const;
+    int pickWeighted(const double *weights) const;
+
+private:
+    Random *_random;
+
+    char _start[NUMKEYS+1];     // the layout given to init()
+    int _hand[NUMKEYS];
+    bool _movable[NUMKEYS];     // mask allows it, and no pinned key lives there
+    bool _slotok[NUMKEYS];      // keys i and i+1 are movable, adjacent, same hand
+
+    bool _locked[0x100];        // indexed by character: must stay on its hand
+    bool _paired[0x100];        // indexed by character: part of a pair
+    std::vector<std::string> _pairs;
+    int _pos[0x100];            // current key index of each character
+
+    IndexSet _singles[2];       // movable, unpaired keys on each hand
+    IndexSet _unlocked[2];      // subset of _singles holding keys free to change hands
+    IndexSet _slots[2];         // free adjacent key pairs on each hand
+    IndexSet _unlockedslots[2]; // subset of _slots holding keys free to change hands
+};
+
+
+#endif
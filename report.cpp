@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <string.h>
+#include "keyboardlayoutoptimizer.h"
+#include "report.h"
+
+using namespace std;
+
+
+// One triad's part of a layout's effort
+struct TriadCost {
+    uint8_t c[3];
+    int count;
+    double cost;
+};
+
+struct LessCostly {
+    bool operator()(const TriadCost &a, const TriadCost &b) const { return a.cost < b.cost; }
+};
+
+
+// What writeReport() finds for one layout.  Loads and rates are fractions of
+// all keystrokes (the first key of every triad) or of all triads.
+struct LayoutReport {
+    double effort;
+    double handload[2];
+    double fingerload[2][4];
+    double rowload[NUMROWS];
+    double samefingerbigrams;
+    double samefingerskipgrams;
+    double samefingertrigrams;
+    double rowjumps;
+    vector<TriadCost> costliest;
+};
+
+
+// Two different keys typed by the same finger
+static bool sameFinger(int a, int b)
+{
+    return a != b && keyInfoTable[a].hand == keyInfoTable[b].hand &&
+           keyInfoTable[a].finger == keyInfoTable[b].finger;
+}
+
+// Two keys of the same hand more than one row apart
+static bool rowJump(int a, int b)
+{
+    int rows = keyInfoTable[a].row - keyInfoTable[b].row;
+    return keyInfoTable[a].hand == keyInfoTable[b].hand && (rows > 1 || rows < -1);
+}
+
+
+// Quote 's' for JSON.  Control characters, and bytes that aren't ascii (so
+// aren't valid UTF-8 on their own), are written as \u00XX.
+static string jsonString(const char *s)
+{
+    string out = "\"";
+    for (; *s; s++) {
+        if ((uint8_t)*s < 0x20 || (uint8_t)*s >= 0x80) {
+            char hex[8];
+            snprintf(hex, sizeof(hex), "\\u%04x", (uint8_t)*s);
+            out += hex;
+            continue;
+        }
+        if (*s == '"' || *s == '\\')
+            out += '\\';
+        out += *s;
+    }
+    return out + "\"";
+}
+
+
+// Everything in the report, in a single pass over the triads
+void KeyboardLayoutOptimizer::reportLayout(const char *layout, int topk, LayoutReport &report)
+{
+    // characters that aren't on the layout map to key 0, as in buildCharToIndexMap()
+    uint8_t index[0x100];
+    memset(index, 0, sizeof(index));
+    for (int i=0; i<NUMKEYS; i++)
+        index[(uint8_t)layout[i]] = i;
+
+    double keycount[NUMKEYS] = { 0 };
+    double effort = 0.0;
+    long sfb = 0, sfs = 0, sft = 0, jumps = 0;
+    TopK<TriadCost, LessCostly> costliest(topk);
+
+    for (size_t n=0; n<_ntriads; n++) {
+        const TriadCount &t = _triadtable[n];
+        int i = index[t.c[0]];
+        int j = index[t.c[1]];
+        int k = index[t.c[2]];
+
+        double cost = _triadeffort[i][j][k] * t.count;
+        effort += cost;
+        keycount[i] += t.count;
+
+        bool ij = sameFinger(i, j);
+        if (ij)
+            sfb += t.count;
+        if (sameFinger(i, k))
+            sfs += t.count;
+        if (ij && sameFinger(j, k))
+            sft += t.count;
+        if (rowJump(i, j))
+            jumps += t.count;
+
+        TriadCost tc = { { t.c[0], t.c[1], t.c[2] }, t.count, cost };
+        costliest.push(tc);
+    }
+
+    double total = _triadcount? (double)_triadcount: 1.0;
+    memset(report.handload, 0, sizeof(report.handload));
+    memset(report.fingerload, 0, sizeof(report.fingerload));
+    memset(report.rowload, 0, sizeof(report.rowload));
+    for (int i=0; i<NUMKEYS; i++) {
+        const KeyInfo &key = keyInfoTable[i];
+        report.handload[key.hand] += keycount[i] / total;
+        if (key.finger < FingerThumb)
+            report.fingerload[key.hand][key.finger] += keycount[i] / total;
+        report.rowload[key.row] += keycount[i] / total;
+    }
+
+    report.effort = effort / total;
+    report.samefingerbigrams = sfb / total;
+    report.samefingerskipgrams = sfs / total;
+    report.samefingertrigrams = sft / total;
+    report.rowjumps = jumps / total;
+    costliest.take(report.costliest);
+}
+
+
+static void writeLayout(FILE *fp, const string &name, const char *layout, const LayoutReport &r, double triadcount)
+{
+    fprintf(fp, "    {\n");
+    fprintf(fp, "      \"name\": %s,\n", jsonString(name.c_str()).c_str());
+    fprintf(fp, "      \"layout\": %s,\n", jsonString(layout).c_str());
+    fprintf(fp, "      \"effort\": %.8f,\n", r.effort);
+    fprintf(fp, "      \"hand_load\": { \"left\": %.6f, \"right\": %.6f },\n", r.handload[LeftHand], r.handload[RightHand]);
+    fprintf(fp, "      \"finger_load\": {\n");
+    for (int h=0; h<2; h++) {
+        const double *f = r.fingerload[h];
+        fprintf(fp, "        \"%s\": { \"pinky\": %.6f, \"ring\": %.6f, \"middle\": %.6f, \"index\": %.6f }%s\n",
+                h == LeftHand? "left": "right", f[FingerPinky], f[FingerRing], f[FingerMiddle], f[FingerIndex],
+                h == LeftHand? ",": "");
+    }
+    fprintf(fp, "      },\n");
+    fprintf(fp, "      \"row_load\": { \"number\": %.6f, \"top\": %.6f, \"home\": %.6f, \"bottom\": %.6f },\n",
+            r.rowload[NumberRow], r.rowload[TopRow], r.rowload[HomeRow], r.rowload[BottomRow]);
+    fprintf(fp, "      \"same_finger_bigrams\": %.6f,\n", r.samefingerbigrams);
+    fprintf(fp, "      \"same_finger_skipgrams\": %.6f,\n", r.samefingerskipgrams);
+    fprintf(fp, "      \"same_finger_trigrams\": %.6f,\n", r.samefingertrigrams);
+    fprintf(fp, "      \"row_jumps\": %.6f,\n", r.rowjumps);
+    fprintf(fp, "      \"costliest_triads\": [");
+    for (size_t i=0; i<r.costliest.size(); i++) {
+        const TriadCost &t = r.costliest[i];
+        char triad[4] = { (char)t.c[0], (char)t.c[1], (char)t.c[2], 0 };
+        fprintf(fp, "%s\n        { \"triad\": %s, \"count\": %d, \"effort\": %.6f, \"share\": %.6f }",
+                i? ",": "", jsonString(triad).c_str(), t.count, t.cost/t.count, (r.effort > 0.0)? t.cost/triadcount/r.effort: 0.0);
+    }
+    fprintf(fp, "%s]\n", r.costliest.empty()? "": "\n      ");
+    fprintf(fp, "    }");
+}
+
+
+// Write a JSON report comparing 'layouts' (name and keys) to 'file', or to
+// stdout if it is "-".  Each layout has its effort, the load on each hand,
+// finger and row, how often a finger types two keys in a row (or with one
+// key between), how often a hand jumps over a row, and its 'topk' most
+// costly triads.
+bool KeyboardLayoutOptimizer::writeReport(const vector<pair<string, string> > &layouts, int topk, const string &file)
+{
+    FILE *fp = (file == "-")? stdout: fopen(file.c_str(), "w");
+    if (!fp) {
+        perror(file.c_str());
+        return false;
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"triads\": %d,\n", _triadcount);
+    fprintf(fp, "  \"unique_triads\": %lu,\n", _ntriads);
+    fprintf(fp, "  \"layouts\": [\n");
+
+    LayoutReport report;
+    for (size_t i=0; i<layouts.size(); i++) {
+        reportLayout(layouts[i].second.c_str(), topk, report);
+        writeLayout(fp, layouts[i].first, layouts[i].second.c_str(), report, _triadcount? _triadcount: 1);
+        fprintf(fp, "%s\n", (i+1 < layouts.size())? ",": "");
+    }
+
+    fprintf(fp, "  ]\n}\n");
+
+    if (fp == stdout)
+        return fflush(fp) == 0;
+    bool ok = (fclose(fp) == 0);
+    printf("Wrote %s\n", file.c_str());
+    return ok;
+}
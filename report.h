@@ -0,0 +1,56 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stddef.h>
+#include <vector>
+#include <algorithm>
+
+
+/* Keeps the 'k' greatest of the values pushed into it, in a min-heap of at
+   most k entries, so finding them costs O(n log k) and k entries of memory
+   rather than a sort of all n.  'Less' orders the values. */
+template <class T, class Less>
+class TopK
+{
+public:
+    TopK(size_t k, Less less = Less())
+        : _k(k), _greater(less) {}
+
+    void push(const T &value)
+    {
+        if (_k == 0)
+            return;
+        if (_heap.size() < _k) {
+            _heap.push_back(value);
+            push_heap(_heap.begin(), _heap.end(), _greater);
+        } else if (_greater.less(_heap.front(), value)) {
+            // replaces the least of the k kept
+            pop_heap(_heap.begin(), _heap.end(), _greater);
+            _heap.back() = value;
+            push_heap(_heap.begin(), _heap.end(), _greater);
+        }
+    }
+
+    // the values kept, greatest first; this empties the heap
+    void take(std::vector<T> &values)
+    {
+        sort_heap(_heap.begin(), _heap.end(), _greater);
+        values.swap(_heap);
+        _heap.clear();
+    }
+
+private:
+    // reversed order, so the heap's front is the least value kept
+    struct Greater {
+        Greater(Less l) : less(l) {}
+        bool operator()(const T &a, const T &b) const { return less(b, a); }
+        Less less;
+    };
+
+    size_t _k;
+    Greater _greater;
+    std::vector<T> _heap;
+};
+
+
+#endif
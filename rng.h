@@ -0,0 +1,53 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+
+/* A random number stream of its own, so that several optimizers can run in
+   one process without sharing rand()'s state.  A given seed produces the
+   same numbers srand()/rand() would.
+
+   random_data points into the state buffer, so a Random can't be copied. */
+class Random
+{
+public:
+    Random(unsigned int seed=1) { setSeed(seed); }
+
+    void setSeed(unsigned int seed)
+    {
+        memset(&_data, 0, sizeof(_data));
+        memset(_state, 0, sizeof(_state));
+        initstate_r(seed, _state, sizeof(_state), &_data);
+    }
+
+    // in [0, RAND_MAX]
+    int next()
+    {
+        int32_t r;
+        random_r(&_data, &r);
+        return r;
+    }
+
+    // in [0, 1)
+    double uniform() { return next()/(RAND_MAX+1.0); }
+
+    // uniform integer in [0, n)
+    int index(int n) { return int(n*uniform()); }
+
+    // uniform integer in [min, max]
+    int range(int min, int max) { return min + index(max-min+1); }
+
+private:
+    Random(const Random &);
+    void operator=(const Random &);
+
+private:
+    struct random_data _data;
+    char _state[128];
+};
+
+
+#endif
@@ -0,0 +1,173 @@
+#include <string.h>
+#include <math.h>
+#include "keyboardlayoutoptimizer.h"
+#include "surrogate.h"
+
+using namespace std;
+
+
+SurrogateEvaluator::SurrogateEvaluator()
+    : _triadcount(1),
+      _scale(1.0),
+      _error(0.0)
+{
+    memset(_paircost, 0, sizeof(_paircost));
+    memset(_chartoindex, 0, sizeof(_chartoindex));
+}
+
+
+// 'effort' must be fully computed
+void SurrogateEvaluator::init(const int (*digraphs)[0x80], int triadcount, const double (*effort)[NUMKEYS][KEYSTRIDE])
+{
+    _triadcount = triadcount? triadcount: 1;
+
+    // E(i,j,k) ~ first(i,j) + second(j,k), where first(i,j) is the mean of
+    // E(i,j,.) and second(j,k) is the mean of E(.,j,k) less that of E(.,j,.)
+    double first[NUMKEYS][NUMKEYS];
+    double second[NUMKEYS][NUMKEYS];
+    double middle[NUMKEYS];
+
+    for (int j=0; j<NUMKEYS; j++) {
+        middle[j] = 0.0;
+        for (int x=0; x<NUMKEYS; x++) {
+            first[x][j] = 0.0;
+            second[j][x] = 0.0;
+            for (int y=0; y<NUMKEYS; y++) {
+                first[x][j] += effort[x][j][y];
+                second[j][x] += effort[y][j][x];
+                middle[j] += effort[x][j][y];
+            }
+            first[x][j] /= NUMKEYS;
+            second[j][x] /= NUMKEYS;
+        }
+        middle[j] /= NUMKEYS*NUMKEYS;
+    }
+
+    for (int i=0; i<NUMKEYS; i++) {
+        for (int j=0; j<NUMKEYS; j++)
+            _paircost[i][j] = first[i][j] + second[i][j] - middle[i];
+    }
+
+    for (int c=0; c<0x80; c++) {
+        _next[c].clear();
+        _prev[c].clear();
+    }
+
+    for (int a=0; a<0x7F; a++) {
+        for (int b=0; b<0x7F; b++) {
+            if (digraphs[a][b] <= 0)
+                continue;
+            _next[a].push_back(make_pair((uint8_t)b, digraphs[a][b]));
+            _prev[b].push_back(make_pair((uint8_t)a, digraphs[a][b]));
+        }
+    }
+
+    _scale = 1.0;
+    _error = 0.0;
+}
+
+
+void SurrogateEvaluator::reset(const char *layout)
+{
+    // characters that aren't on the layout map to key 0, as in buildCharToIndexMap()
+    memset(_chartoindex, 0, sizeof(_chartoindex));
+    for (int i=0; i<NUMKEYS; i++)
+        _chartoindex[(uint8_t)layout[i]] = i;
+}
+
+
+double SurrogateEvaluator::tryKeys(const char *layout, const int *keys, int nkeys) const
+{
+    uint8_t index[0x80];
+    bool moved[0x80];
+    memcpy(index, _chartoindex, sizeof(index));
+    memset(moved, 0, sizeof(moved));
+
+    for (int i=0; i<nkeys; i++) {
+        uint8_t c = layout[keys[i]];
+        if (c < 0x80) {
+            index[c] = keys[i];
+            moved[c] = true;
+        }
+    }
+
+    // every digraph with a moved character, once
+    double delta = 0.0;
+    for (int c=0; c<0x80; c++) {
+        if (!moved[c])
+            continue;
+
+        int from = _chartoindex[c];
+        int to = index[c];
+
+        const vector<pair<uint8_t, int> > &next = _next[c];
+        for (size_t i=0; i<next.size(); i++) {
+            uint8_t b = next[i].first;
+            delta += next[i].second * (_paircost[to][index[b]] - _paircost[from][_chartoindex[b]]);
+        }
+
+        const vector<pair<uint8_t, int> > &prev = _prev[c];
+        for (size_t i=0; i<prev.size(); i++) {
+            uint8_t a = prev[i].first;
+            if (moved[a])
+                continue;
+            delta += prev[i].second * (_paircost[index[a]][to] - _paircost[index[a]][from]);
+        }
+    }
+
+    return delta / _triadcount;
+}
+
+
+void SurrogateEvaluator::updateKeys(const char *layout, const int *keys, int nkeys)
+{
+    for (int i=0; i<nkeys; i++)
+        _chartoindex[(uint8_t)layout[keys[i]]] = keys[i];
+}
+
+
+double SurrogateEvaluator::estimate(const char *layout) const
+{
+    uint8_t index[0x80];
+    memset(index, 0, sizeof(index));
+    for (int i=0; i<NUMKEYS; i++) {
+        if ((uint8_t)layout[i] < 0x80)
+            index[(uint8_t)layout[i]] = i;
+    }
+
+    double total = 0.0;
+    for (int a=0; a<0x80; a++) {
+        for (size_t i=0; i<_next[a].size(); i++)
+            total += _next[a][i].second * _paircost[index[a]][index[_next[a][i].first]];
+    }
+
+    return total / _triadcount;
+}
+
+
+void SurrogateEvaluator::calibrate(const vector<double> &estimates, const vector<double> &actuals)
+{
+    // least squares scale through the origin, then the worst overestimate
+    double xy = 0.0, xx = 0.0;
+    for (size_t i=0; i<estimates.size(); i++) {
+        xy += estimates[i] * actuals[i];
+        xx += estimates[i] * estimates[i];
+    }
+    _scale = (xx > 0.0)? xy/xx: 1.0;
+
+    double worst = 0.0;
+    for (size_t i=0; i<estimates.size(); i++)
+        worst = fmax(worst, _scale*estimates[i] - actuals[i]);
+    _error = worst * SCREEN_MARGIN;
+}
+
+
+bool SurrogateEvaluator::audit(double estimate, double actual)
+{
+    double over = _scale*estimate - actual;
+    if (over <= _error)
+        return true;
+
+    _error = over * SCREEN_MARGIN;
+    return false;
+}
@@ -0,0 +1,69 @@
+#ifndef SURROGATE_H
+#define SURROGATE_H
+
+#include <stdint.h>
+#include <vector>
+#include "configuration.h"
+
+
+/* A cheap estimate of how much a move changes the effort, from the digraph
+   counts instead of the triads.
+
+   A triad's effort is approximated as a cost for its first digraph plus one
+   for its second, each the mean of the triad table over the key left out.
+   The first digraph cost carries each key's base (stroke) effort.  Since
+   _digraphs counts the first digraph of every triad, the estimate sums
+   pair costs over the digraph counts alone.
+
+   The estimate is calibrated against the real effort: a scale, and a bound
+   on how far the scaled estimate may be above the real change.  Moves whose
+   lowerBound() says they will be rejected needn't be scored in full.  The
+   bound is only the worst error seen on sample moves, with a margin, so it
+   can be wrong; audit() checks it against real changes and widens it, but
+   only after a move was wrongly rejected.  A bound that holds for every move
+   (from the largest residual of the triad table against the digraph model)
+   is too loose to reject more than a few percent of moves. */
+class SurrogateEvaluator
+{
+public:
+    SurrogateEvaluator();
+
+    void init(const int (*digraphs)[0x80], int triadcount, const double (*effort)[NUMKEYS][KEYSTRIDE]);
+    void reset(const char *layout);
+
+    // Estimated change in effort once the keys 'keys' of 'layout' changed
+    // since the last update, leaving the state alone.
+    double tryKeys(const char *layout, const int *keys, int nkeys) const;
+    void updateKeys(const char *layout, const int *keys, int nkeys);
+
+    // estimate of the whole effort of 'layout', from scratch
+    double estimate(const char *layout) const;
+
+    // Fit the scale and error bound to pairs of estimated and real changes
+    void calibrate(const std::vector<double> &estimates, const std::vector<double> &actuals);
+
+    // the least the real change can be, given an estimate
+    double lowerBound(double estimate) const { return _scale*estimate - _error; }
+
+    // Check one real change against its estimate.  Returns false, and
+    // widens the bound to cover it, if it was below lowerBound().
+    bool audit(double estimate, double actual);
+
+    double scale() const { return _scale; }
+    double error() const { return _error; }
+
+private:
+    double _triadcount;
+    double _paircost[NUMKEYS][NUMKEYS];
+
+    // the nonzero digraphs each character starts and ends, with their counts
+    std::vector<std::pair<uint8_t, int> > _next[0x80];
+    std::vector<std::pair<uint8_t, int> > _prev[0x80];
+
+    uint8_t _chartoindex[0x100];
+    double _scale;
+    double _error;
+};
+
+
+#endif
@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include "keyboardlayoutoptimizer.h"
+#include "sweep.h"
+
+using namespace std;
+
+
+static const char *paramNames[] = { "t0", "p0", "k", "iterations", "rounds", "seed" };
+static const int NPARAMS = 6;
+
+
+// The values one parameter takes in a sweep: either a list, or the range
+// [lo, hi] split into n values.  A random search needn't split it.
+struct SweepAxis {
+    bool given;
+    bool range;
+    vector<double> values;
+    double lo, hi;
+    int n;
+};
+
+
+static bool isWhole(int param)
+{
+    return param >= 3;
+}
+
+
+static double getParam(const SweepConfig &config, int param)
+{
+    switch (param) {
+    case 0: return config.t0;
+    case 1: return config.p0;
+    case 2: return config.k;
+    case 3: return config.iterations;
+    case 4: return config.rounds;
+    default: return config.seed;
+    }
+}
+
+
+static void setParam(SweepConfig &config, int param, double value)
+{
+    switch (param) {
+    case 0: config.t0 = value; break;
+    case 1: config.p0 = value; break;
+    case 2: config.k = value; break;
+    case 3: config.iterations = lround(value); break;
+    case 4: config.rounds = lround(value); break;
+    default: config.seed = lround(value); break;
+    }
+}
+
+
+// Whether a schedule can run with 'value' for 'param': k must be above 0,
+// and there must be at least one iteration and round
+static bool validParam(int param, double value)
+{
+    switch (param) {
+    case 2: return value > 0.0;
+    case 3:
+    case 4: return lround(value) >= 1;
+    default: return true;
+    }
+}
+
+
+static bool parseAxis(int param, const string &text, SweepAxis &axis)
+{
+    double lo, hi;
+    int n = 0;
+    int fields = sscanf(text.c_str(), "%lf:%lf:%d", &lo, &hi, &n);
+
+    axis.given = true;
+    axis.values.clear();
+    axis.range = (text.find(':') != string::npos);
+
+    if (axis.range) {
+        if (fields < 2 || (fields == 3 && n < 1) || hi < lo ||
+            !validParam(param, lo) || !validParam(param, hi))
+            return false;
+        if (fields == 2)
+            n = isWhole(param)? lround(hi - lo) + 1: 0;
+        axis.lo = lo;
+        axis.hi = hi;
+        axis.n = n;
+        for (int i=0; i<n; i++)
+            axis.values.push_back((n == 1)? lo: lo + (hi-lo)*i/(n-1));
+        return true;
+    }
+
+    size_t start = 0;
+    while (start <= text.length()) {
+        size_t comma = text.find(',', start);
+        if (comma == string::npos)
+            comma = text.length();
+        char *end;
+        string value = text.substr(start, comma-start);
+        axis.values.push_back(strtod(value.c_str(), &end));
+        if (value.empty() || *end || !validParam(param, axis.values.back()))
+            return false;
+        start = comma+1;
+    }
+    return true;
+}
+
+
+bool parseSweep(const string &spec, int samples, unsigned int seed, const SweepConfig &base, vector<SweepConfig> &configs)
+{
+    SweepAxis axes[NPARAMS];
+    for (int i=0; i<NPARAMS; i++) {
+        axes[i].given = false;
+        axes[i].range = false;
+        axes[i].values.push_back(getParam(base, i));
+    }
+
+    size_t start = 0;
+    while (start < spec.length()) {
+        size_t end = spec.find_first_of(" ;", start);
+        if (end == string::npos)
+            end = spec.length();
+        string setting = spec.substr(start, end-start);
+        start = end+1;
+        if (setting.empty())
+            continue;
+
+        size_t eq = setting.find('=');
+        string name = setting.substr(0, eq);
+        int param = 0;
+        while (param < NPARAMS && name != paramNames[param])
+            param++;
+
+        if (eq == string::npos || param == NPARAMS || !parseAxis(param, setting.substr(eq+1), axes[param])) {
+            fprintf(stderr, "Bad sweep setting '%s'\n", setting.c_str());
+            return false;
+        }
+    }
+
+    configs.clear();
+
+    if (samples > 0) {
+        Random random(seed);
+        for (int s=0; s<samples; s++) {
+            SweepConfig config = base;
+            for (int i=0; i<NPARAMS; i++) {
+                const SweepAxis &axis = axes[i];
+                if (!axis.given)
+                    continue;
+                double value;
+                if (axis.range && isWhole(i))
+                    value = axis.lo + random.index(lround(axis.hi - axis.lo) + 1);
+                else if (axis.range)
+                    value = axis.lo + (axis.hi - axis.lo)*random.uniform();
+                else
+                    value = axis.values[random.index(axis.values.size())];
+                setParam(config, i, value);
+            }
+            configs.push_back(config);
+        }
+        return true;
+    }
+
+    // every combination, the last parameter (seed) varying fastest
+    size_t total = 1;
+    for (int i=0; i<NPARAMS; i++) {
+        if (axes[i].values.empty()) {
+            fprintf(stderr, "A grid needs the number of values for %s, as lo:hi:n\n", paramNames[i]);
+            return false;
+        }
+        total *= axes[i].values.size();
+    }
+
+    for (size_t c=0; c<total; c++) {
+        SweepConfig config = base;
+        size_t rest = c;
+        for (int i=NPARAMS-1; i>=0; i--) {
+            size_t n = axes[i].values.size();
+            setParam(config, i, axes[i].values[rest % n]);
+            rest /= n;
+        }
+        configs.push_back(config);
+    }
+    return true;
+}
+
+
+
+struct SweepResult {
+    double effort;        // best final effort over the rounds, as main() reports it
+    double besteffort;    // best effort seen at any point
+    char layout[NUMKEYS+1];
+    double timetobest;
+    double seconds;
+    double rate;
+};
+
+
+static void writeResults(FILE *fp, bool json, const vector<SweepConfig> &configs, const vector<SweepResult> &results)
+{
+    if (json)
+        fprintf(fp, "[\n");
+    else
+        fprintf(fp, "config,t0,p0,k,iterations,rounds,seed,effort,best_effort,time_to_best,seconds,layouts_per_sec,layout\n");
+
+    for (size_t i=0; i<configs.size(); i++) {
+        const SweepConfig &c = configs[i];
+        const SweepResult &r = results[i];
+
+        // quote the layout, which has both '"' and ',' in it
+        string layout;
+        for (const char *p=r.layout; *p; p++) {
+            if (json && (*p == '"' || *p == '\\'))
+                layout += '\\';
+            else if (!json && *p == '"')
+                layout += '"';
+            layout += *p;
+        }
+
+        if (json) {
+            fprintf(fp, "  {\"config\": %lu, \"t0\": %g, \"p0\": %g, \"k\": %g, \"iterations\": %d, \"rounds\": %d, "
+                        "\"seed\": %u, \"effort\": %.6f, \"best_effort\": %.6f, \"time_to_best\": %.3f, "
+                        "\"seconds\": %.3f, \"layouts_per_sec\": %.0f, \"layout\": \"%s\"}%s\n",
+                    i, c.t0, c.p0, c.k, c.iterations, c.rounds, c.seed, r.effort, r.besteffort, r.timetobest,
+                    r.seconds, r.rate, layout.c_str(), (i+1 < configs.size())? ",": "");
+        } else {
+            fprintf(fp, "%lu,%g,%g,%g,%d,%d,%u,%.6f,%.6f,%.3f,%.3f,%.0f,\"%s\"\n",
+                    i, c.t0, c.p0, c.k, c.iterations, c.rounds, c.seed, r.effort, r.besteffort, r.timetobest,
+                    r.seconds, r.rate, layout.c_str());
+        }
+    }
+
+    if (json)
+        fprintf(fp, "]\n");
+}
+
+
+static void runConfig(KeyboardLayoutOptimizer *klo, const SweepConfig &config, const char *start, SweepResult &result)
+{
+    char layout[NUMKEYS+1];
+    double elapsed = 0.0;
+
+    // efforts cached by an earlier configuration would make this one faster
+    // (and, when screening, change which random numbers it draws)
+    klo->clearCache();
+    klo->setSeed(config.seed);
+    result.effort = result.besteffort = HUGE_VAL;
+    result.timetobest = 0.0;
+    memcpy(result.layout, start, NUMKEYS+1);
+
+    for (int r=0; r<config.rounds; r++) {
+        memcpy(layout, start, NUMKEYS+1);
+        double effort = klo->optimizeLayout(layout, config.iterations, config.t0, config.p0, config.k);
+        const OptimizeStats &stats = klo->lastStats();
+
+        result.effort = fmin(result.effort, effort);
+        if (stats.besteffort < result.besteffort) {
+            result.besteffort = stats.besteffort;
+            result.timetobest = elapsed + stats.timetobest;
+            memcpy(result.layout, stats.bestlayout, NUMKEYS+1);
+        }
+        elapsed += stats.seconds;
+    }
+
+    result.seconds = elapsed;
+    result.rate = (elapsed > 0.0)? (double)config.iterations*config.rounds/elapsed: 0.0;
+}
+
+
+bool runSweep(const KeyboardLayoutOptimizer *klo, const vector<SweepConfig> &configs,
+              const char *layout, int threads, const string &output)
+{
+    size_t len = output.length();
+    bool json = len >= 5 && output.compare(len-5, 5, ".json") == 0;
+    FILE *fp = fopen(output.c_str(), "w");
+    if (!fp) {
+        perror(output.c_str());
+        return false;
+    }
+
+    if (threads < 1)
+        threads = 1;
+    if ((size_t)threads > configs.size())
+        threads = configs.size();
+
+    printf("Sweeping %lu configurations on %d threads\n", configs.size(), threads);
+    fflush(stdout);
+
+    vector<SweepResult> results(configs.size());
+    TlbCounter tlb;
+    tlb.start();
+
+    atomic<size_t> next(0);
+    mutex printlock;
+    size_t done = 0;
+
+    // each thread takes the next configuration until there are none left
+    vector<thread> pool;
+    for (int t=0; t<threads; t++) {
+        pool.push_back(thread([&, t]() {
+            // pinned before spawning, so the tables it gets are on its node
+            pinThread(t);
+            KeyboardLayoutOptimizer *chain = klo->spawn();
+            chain->setVerbose(false);
+
+            size_t i;
+            while ((i = next++) < configs.size()) {
+                runConfig(chain, configs[i], layout, results[i]);
+
+                lock_guard<mutex> guard(printlock);
+                const SweepConfig &c = configs[i];
+                printf("[%lu/%lu] t0=%g p0=%g k=%g iterations=%d rounds=%d seed=%u: %.6f in %.1fs\n",
+                        ++done, configs.size(), c.t0, c.p0, c.k, c.iterations, c.rounds, c.seed,
+                        results[i].effort, results[i].seconds);
+                fflush(stdout);
+            }
+
+            delete chain;
+        }));
+    }
+    for (size_t t=0; t<pool.size(); t++)
+        pool[t].join();
+    uint64_t tlbmisses = tlb.stop();
+
+    writeResults(fp, json, configs, results);
+    bool ok = (fclose(fp) == 0);
+    printf("Wrote %s\n", output.c_str());
+
+    long layouts = 0;
+    for (size_t i=0; i<configs.size(); i++)
+        layouts += (long)configs[i].iterations * configs[i].rounds;
+    printf("Tables: %s pages\n", klo->hugeTables()? "huge": "normal");
+    if (tlb.available())
+        printf("dTLB misses: %llu (%.2f per layout)\n", (unsigned long long)tlbmisses, (double)tlbmisses/layouts);
+    else
+        printf("dTLB misses: unavailable\n");
+    return ok;
+}
@@ -0,0 +1,46 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <string>
+#include <vector>
+
+class KeyboardLayoutOptimizer;
+
+
+// The annealing schedule and seed of one configuration in a sweep
+struct SweepConfig {
+    double t0;
+    double p0;
+    double k;
+    int iterations;
+    int rounds;
+    unsigned int seed;
+};
+
+
+/* Expand a sweep specification into configurations.  The specification is
+   a list of parameter settings separated by spaces or ';', eg.
+
+     "t0=0.25,0.5,1 p0=0.1:0.5:5 seed=1:4"
+
+   Parameters are t0, p0, k, iterations, rounds and seed.  A setting is a
+   list of values, or a range lo:hi:n of n evenly spaced values (for whole
+   number parameters, lo:hi is every number in between).  Parameters that
+   aren't given keep their values from 'base'.  k must be above 0, and
+   iterations and rounds at least 1.
+
+   With 'samples' zero every combination is run (a grid search).  Otherwise
+   that many configurations are drawn at random, each parameter uniformly
+   from its range or list, using 'seed'. */
+bool parseSweep(const std::string &spec, int samples, unsigned int seed, const SweepConfig &base,
+                std::vector<SweepConfig> &configs);
+
+// Run every configuration, starting from 'layout', on 'threads' threads.
+// Each thread optimizes with its own optimizer spawned from 'klo', so the
+// corpus and effort tables are shared.  One row per configuration is
+// written to 'output', as JSON if its name ends in .json and CSV otherwise.
+bool runSweep(const KeyboardLayoutOptimizer *klo, const std::vector<SweepConfig> &configs,
+              const char *layout, int threads, const std::string &output);
+
+
+#endif
@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "keyboardlayoutoptimizer.h"
+
+
+extern char qwerty_layout[NUMKEYS+1];
+extern uint8_t layoutMask[NUMKEYS];
+
+
+// The reference evaluator's own copies of the key and row tables, and of
+// the triad effort calculation, as they were before any optimization.
+// Don't change them along with their counterparts in
+// keyboardlayoutoptimizer.cpp: they are what that code is checked against.
+static const KeyInfo referenceKeys[NUMKEYS] = {
+    { LeftHand,  NumberRow,  FingerPinky  },   // `
+    { LeftHand,  NumberRow,  FingerRing   },   // 1
+    { LeftHand,  NumberRow,  FingerRing   },   // 2
+    { LeftHand,  NumberRow,  FingerMiddle },   // 3
+    { LeftHand,  NumberRow,  FingerIndex  },   // 4
+    { LeftHand,  NumberRow,  FingerIndex  },   // 5
+    { LeftHand,  NumberRow,  FingerIndex  },   // 6
+    { RightHand, NumberRow,  FingerIndex  },   // 7
+    { RightHand, NumberRow,  FingerMiddle },   // 8
+    { RightHand, NumberRow,  FingerMiddle },   // 9
+    { RightHand, NumberRow,  FingerRing   },   // 0
+    { RightHand, NumberRow,  FingerPinky  },   // [
+    { RightHand, NumberRow,  FingerPinky  },   // ]
+
+    { LeftHand,  TopRow,     FingerPinky  },   // '
+    { LeftHand,  TopRow,     FingerRing   },   // ,
+    { LeftHand,  TopRow,     FingerMiddle },   // .
+    { LeftHand,  TopRow,     FingerIndex  },   // p
+    { LeftHand,  TopRow,     FingerIndex  },   // y
+    { RightHand, TopRow,     FingerIndex  },   // f
+    { RightHand, TopRow,     FingerIndex  },   // g
+    { RightHand, TopRow,     FingerMiddle },   // c
+    { RightHand, TopRow,     FingerRing   },   // r
+    { RightHand, TopRow,     FingerPinky  },   // l
+    { RightHand, TopRow,     FingerPinky  },   // /
+    { RightHand, TopRow,     FingerPinky  },   // =
+    { RightHand, TopRow,     FingerPinky  },   // backslash 
+
+    { LeftHand,  HomeRow,    FingerPinky  },   // a
+    { LeftHand,  HomeRow,    FingerRing   },   // o
+    { LeftHand,  HomeRow,    FingerMiddle },   // e
+    { LeftHand,  HomeRow,    FingerIndex  },   // u
+    { LeftHand,  HomeRow,    FingerIndex  },   // i
+    { RightHand, HomeRow,    FingerIndex  },   // d
+    { RightHand, HomeRow,    FingerIndex  },   // h
+    { RightHand, HomeRow,    FingerMiddle },   // t
+    { RightHand, HomeRow,    FingerRing   },   // n
+    { RightHand, HomeRow,    FingerPinky  },   // s
+    { RightHand, HomeRow,    FingerPinky  },   // -
+
+    { LeftHand,  BottomRow,  FingerPinky  },   // ;
+    { LeftHand,  BottomRow,  FingerRing   },   // q
+    { LeftHand,  BottomRow,  FingerMiddle },   // j
+    { LeftHand,  BottomRow,  FingerIndex  },   // k
+    { LeftHand,  BottomRow,  FingerIndex  },   // x
+    { RightHand, BottomRow,  FingerIndex  },   // b
+    { RightHand, BottomRow,  FingerIndex  },   // m
+    { RightHand, BottomRow,  FingerMiddle },   // w
+    { RightHand, BottomRow,  FingerRing   },   // v
+    { RightHand, BottomRow,  FingerPinky  },   // z
+};
+
+static const int referenceRowFlags[NUMROWS][NUMROWS][NUMROWS] = {
+    {{0, 1, 1, 1},     // [0][0][0], [0][0][1], [0][0][2], [0][0][3]
+     {3, 1, 4, 4},     // [0][1][0], [0][1][1], [0][1][2], [0][1][3]
+     {5, 5, 1, 4},     // [0][2][0], [0][2][1], [0][2][2], [0][2][3]
+     {5, 5, 5, 1}},    // [0][3][0], [0][3][1], [0][3][2], [0][3][3]
+  
+    {{2, 3, 5, 5},     // [1][0][0], [1][0][1], [1][0][2], [1][0][3]
+     {2, 0, 1, 1},     // [1][1][0], [1][1][1], [1][1][2], [1][1][3]
+     {5, 3, 1, 4},     // [1][2][0], [1][2][1], [1][2][2], [1][2][3]
+     {5, 5, 5, 1}},    // [1][3][0], [1][3][1], [1][3][2], [1][3][3]
+
+    {{2, 5, 5, 5},     // [2][0][0], [2][0][1], [2][0][2], [2][0][3]
+     {6, 2, 3, 5},     // [2][1][0], [2][1][1], [2][1][2], [2][1][3]
+     {2, 2, 0, 1},     // [2][2][0], [2][2][1], [2][2][2], [2][2][3]
+     {5, 5, 3, 1}},    // [2][3][0], [2][3][1], [2][3][2], [2][3][3]
+
+    {{2, 5, 5, 5},     // [3][0][0], [3][0][1], [3][0][2], [3][0][3]
+     {6, 2, 5, 5},     // [3][1][0], [3][1][1], [3][1][2], [3][1][3]
+     {6, 6, 2, 3},     // [3][2][0], [3][2][1], [3][2][2], [3][2][3]
+     {2, 2, 2, 0}},    // [3][3][0], [3][3][1], [3][3][2], [3][3][3]
+};
+
+
+double KeyboardLayoutOptimizer::referenceTriadEffort(int ikey1, int ikey2, int ikey3)
+{
+    const KeyInfo &key1 = referenceKeys[ikey1];
+    const KeyInfo &key2 = referenceKeys[ikey2];
+    const KeyInfo &key3 = referenceKeys[ikey3];
+
+    double k1beffort = _config.baseEffort(ikey1);
+    double k2beffort = _config.baseEffort(ikey1);
+    double k3beffort = _config.baseEffort(ikey1);
+
+    //int handflag   = 0;
+    int fingerflag = 0;
+    int rowflag    = 0;
+
+    // Add penalty for how the triad is distributed among the hands
+    // 0 for LRR/LLR/RLL/RRL
+    // 1 for LRL/RLR
+    // 2 for LLL/RRR
+    //if (key1.hand == key3.hand)
+    //    handflag = (key2.hand == key3.hand? 2: 1);
+
+    // all keys on same hand
+    if (key1.hand == key2.hand && key2.hand == key3.hand) {
+        if (key1.finger < key2.finger) {
+            if      (key2.finger <  key3.finger) { fingerflag = 0; }
+            else if (key2.finger == key3.finger) { fingerflag = (ikey2 != ikey3? 5: 0); }
+            else if (key1.finger == key3.finger) { fingerflag = 4; }
+            else if (key1.finger <  key3.finger) { fingerflag = 2; }
+            else /* key3.finger < key1.finger */ { fingerflag = 3; }
+
+        } else if (key1.finger == key2.finger) {
+            if      (key2.finger <  key3.finger) { fingerflag = (ikey1 != ikey2)? 4: 1; }
+            else if (key2.finger == key3.finger) { fingerflag = (ikey1 != ikey2 && ikey2 != ikey3 && ikey1 != ikey3)? 7: 5; }
+            else if (key2.finger >  key3.finger) { fingerflag = (ikey1 != ikey2)? 5: 1; }
+
+        } else {  /* key1.finger > key2.finger */
+            if      (key2.finger > key3.finger)  { fingerflag = 3; }
+            else if (key2.finger == key3.finger) { fingerflag = (ikey2 != ikey3)? 4: 1; }
+            else if (key1.finger == key3.finger) { fingerflag = 4; }
+            else if (key2.finger < key3.finger)  { fingerflag = 5; }
+            else /* key1.finger < key3.finger */ { fingerflag = 3; }
+        }
+
+    // first two keys on same hand
+    } else if (key1.hand == key2.hand) {
+        if (key1.finger == key2.finger) {
+            fingerflag = (ikey1 != ikey2)? 3: 1;
+        } else if (key1.finger > key2.finger) {
+            fingerflag = 2;
+        }
+
+    // last two keys on same hand 
+    } else if (key2.hand == key3.hand) {
+        if (key2.finger == key3.finger) {
+            fingerflag = (ikey2 != ikey3)? 3: 1;
+        } else if (key2.finger > key3.finger) {
+            fingerflag = 2;
+        }
+
+    // no sequential keys on same hand
+    } else {  /* key1.hand == key3.hand */
+        fingerflag = 0;
+    }
+
+    rowflag = referenceRowFlags[key1.row][key2.row][key3.row];
+
+    //double stroke_effort = kb*(k1*k1beffort + (1 + k2*k2beffort * (1 + k3*k3beffort)));
+    //double path_effort   = 1.0*handflag + 0.3*fingerflag + 0.3*rowflag;
+    double stroke_effort = 2.0*(k1*k1beffort + (1 + k2*k2beffort * (1 + k3*k3beffort)));
+    double path_effort   = 0.3*fingerflag + 0.4*rowflag;
+
+    return stroke_effort + path_effort;
+}
+
+
+// Reference evaluator.  This is the original, unoptimized effort calculation:
+// walk the triad map and compute every triad's effort from scratch.  It is
+// deliberately kept slow and simple so the faster evaluators can be checked
+// against it; don't optimize it.
+double KeyboardLayoutOptimizer::referenceLayoutEffort(const char *layout)
+{
+    // characters that aren't on the layout map to key 0
+    uint8_t chartoindex[0x100];
+    memset(chartoindex, 0, sizeof(chartoindex));
+    for (int i=0; i<NUMKEYS; i++)
+        chartoindex[(uint8_t)layout[i]] = i;
+
+    double effort = 0.0;
+
+    map<string, int>::iterator it;
+    for (it = _triadmap.begin(); it != _triadmap.end(); it++) {
+        int ikey1 = chartoindex[(uint8_t)it->first[0]];
+        int ikey2 = chartoindex[(uint8_t)it->first[1]];
+        int ikey3 = chartoindex[(uint8_t)it->first[2]];
+        effort += referenceTriadEffort(ikey1, ikey2, ikey3) * it->second;
+    }
+
+    return effort / (double)_triadcount;
+}
+
+
+static bool withinTolerance(double expected, double actual)
+{
+    return fabs(expected-actual) <= VERIFY_TOLERANCE * fmax(1.0, fabs(expected));
+}
+
+
+static void printMismatch(const char *evaluator, size_t step, double expected, double actual)
+{
+    printf("  step %lu: %s = %.12f, reference = %.12f (diff %.3g)\n",
+            step, evaluator, actual, expected, actual-expected);
+}
+
+
+// Apply 'swaps' to 'start' one at a time, checking every evaluator against
+// the reference after each step.  Returns false on the first mismatch.
+bool KeyboardLayoutOptimizer::verifyCase(const char *start, const vector<pair<int,int> > &swaps, bool report)
+{
+    char layout[NUMKEYS+1];
+    memcpy(layout, start, NUMKEYS);
+    layout[NUMKEYS] = 0;
+
+    uint64_t hash = _cache.hash(layout);
+
+    DeltaEvaluator delta;
+    delta.init(_triadtable, _ntriads, _triadcount, (const double (*)[NUMKEYS][KEYSTRIDE])_triadeffort);
+    delta.reset(layout);
+
+    // the truncated evaluator, scoring only _head, must stay within
+    // _tailbound of the reference
+    DeltaEvaluator truncated;
+    if (!_head.empty()) {
+        truncated.init(&_head[0], _head.size(), _triadcount, _triadeffort, _tailoffset);
+        truncated.reset(layout);
+    }
+
+    SurrogateEvaluator surrogate;
+    surrogate.init(_digraphs, _triadcount, (const double (*)[NUMKEYS][KEYSTRIDE])_triadeffort);
+    surrogate.reset(layout);
+    double estimate = surrogate.estimate(layout);
+
+    for (size_t step=0; step<=swaps.size(); step++) {
+        if (step > 0) {
+            int key1 = swaps[step-1].first;
+            int key2 = swaps[step-1].second;
+            hash = _cache.swapHash(hash, layout, key1, key2);
+            char hold = layout[key1];
+            layout[key1] = layout[key2];
+            layout[key2] = hold;
+
+            // trying a swap must agree with making it, and a swap that is
+            // rolled back must leave no trace
+            int keys[2] = { key1, key2 };
+            double tried = delta.tryKeys(layout, keys, 2);
+            double before = delta.effort();
+            delta.swapKeys(layout, key1, key2);
+            if (!withinTolerance(delta.effort(), tried)) {
+                if (report)
+                    printMismatch("DeltaEvaluator::tryKeys", step, delta.effort(), tried);
+                return false;
+            }
+            delta.rollback();
+            if (delta.effort() != before) {
+                if (report)
+                    printMismatch("DeltaEvaluator::rollback", step, before, delta.effort());
+                return false;
+            }
+            delta.swapKeys(layout, key1, key2);
+            delta.commit();
+            if (!_head.empty()) {
+                truncated.swapKeys(layout, key1, key2);
+                truncated.commit();
+            }
+
+            // the surrogate's change for a swap must match its own estimate
+            // from scratch; it only approximates the real effort
+            double change = surrogate.tryKeys(layout, keys, 2);
+            surrogate.updateKeys(layout, keys, 2);
+            double next = surrogate.estimate(layout);
+            if (!withinTolerance(next - estimate, change)) {
+                if (report)
+                    printMismatch("SurrogateEvaluator::tryKeys", step, next - estimate, change);
+                return false;
+            }
+            estimate = next;
+        }
+
+        double expected = referenceLayoutEffort(layout);
+
+        double actual = computeLayoutEffort(layout);
+        if (!withinTolerance(expected, actual)) {
+            if (report)
+                printMismatch("computeLayoutEffort", step, expected, actual);
+            return false;
+        }
+
+        actual = delta.effort();
+        if (!withinTolerance(expected, actual)) {
+            if (report)
+                printMismatch("DeltaEvaluator", step, expected, actual);
+            return false;
+        }
+
+        if (!_head.empty()) {
+            actual = truncated.effort();
+            if (fabs(actual - expected) > _tailbound + VERIFY_TOLERANCE * fmax(1.0, fabs(expected))) {
+                if (report) {
+                    printMismatch("truncated DeltaEvaluator", step, expected, actual);
+                    printf("  (allowed error %.6f)\n", _tailbound);
+                }
+                return false;
+            }
+        }
+
+        // the per-key shares must add up to the whole
+        actual = 0.0;
+        for (int i=0; i<0x100; i++)
+            actual += delta.contribution(i);
+        if (!withinTolerance(expected, actual)) {
+            if (report)
+                printMismatch("DeltaEvaluator::contribution", step, expected, actual);
+            return false;
+        }
+
+        // the incrementally updated hash must match a fresh one, and the
+        // cache must hand back the effort of this exact layout
+        if (hash != _cache.hash(layout)) {
+            if (report)
+                printf("  step %lu: incremental zobrist hash %016lx != %016lx\n", step, hash, _cache.hash(layout));
+            return false;
+        }
+        if (_cache.lookup(hash, actual) && !withinTolerance(expected, actual)) {
+            if (report)
+                printMismatch("EvalCache", step, expected, actual);
+            return false;
+        }
+        _cache.store(hash, expected);
+    }
+
+    return true;
+}
+
+
+// Shrink a failing swap sequence to one that still fails but where every
+// remaining swap is needed to reproduce the mismatch
+static void minimizeCase(KeyboardLayoutOptimizer *klo,
+                         bool (KeyboardLayoutOptimizer::*check)(const char *, const vector<pair<int,int> > &, bool),
+                         const char *layout,
+                         vector<pair<int,int> > &swaps)
+{
+    // shortest failing prefix
+    for (size_t n=0; n<swaps.size(); n++) {
+        vector<pair<int,int> > prefix(swaps.begin(), swaps.begin()+n);
+        if (!(klo->*check)(layout, prefix, false)) {
+            swaps = prefix;
+            break;
+        }
+    }
+
+    // drop any swap that isn't needed
+    for (size_t i=swaps.size(); i-- > 0; ) {
+        vector<pair<int,int> > fewer(swaps);
+        fewer.erase(fewer.begin()+i);
+        if (!(klo->*check)(layout, fewer, false))
+            swaps = fewer;
+    }
+}
+
+
+// Differential test of the evaluators: generate random layouts (moving only
+// the keys allowed by layoutMask) and random swap sequences, and compare every
+// evaluator against referenceLayoutEffort() after each swap.
+bool KeyboardLayoutOptimizer::verifyEvaluators(int cases, int maxswaps, unsigned int seed)
+{
+    printf("Verifying evaluators: %d cases, up to %d swaps each, seed %u\n", cases, maxswaps, seed);
+
+    if (_coverage >= 1.0)
+        setCoverage(VERIFY_COVERAGE);
+
+    vector<int> movable;
+    for (int i=0; i<NUMKEYS; i++) {
+        if (layoutMask[i])
+            movable.push_back(i);
+    }
+
+    int nmovable = movable.size();
+    if (nmovable < 2) {
+        printf("layoutMask has fewer than 2 movable keys\n");
+        return false;
+    }
+
+    int failures = 0;
+    long steps = 0;
+    char layout[NUMKEYS+1];
+    vector<pair<int,int> > swaps;
+
+    for (int c=0; c<cases; c++) {
+        // shuffle the movable keys of qwerty to get a random starting layout
+        memcpy(layout, qwerty_layout, NUMKEYS+1);
+        for (int i=nmovable-1; i>0; i--) {
+            int j = rand_r(&seed) % (i+1);
+            char hold = layout[movable[i]];
+            layout[movable[i]] = layout[movable[j]];
+            layout[movable[j]] = hold;
+        }
+
+        swaps.clear();
+        int nswaps = 1 + rand_r(&seed) % maxswaps;
+        for (int i=0; i<nswaps; i++) {
+            int key1 = movable[rand_r(&seed) % nmovable];
+            int key2 = movable[rand_r(&seed) % (nmovable-1)];
+            if (key2 == key1)
+                key2 = movable[nmovable-1];
+            swaps.push_back(make_pair(key1, key2));
+        }
+        steps += nswaps+1;
+
+        if (verifyCase(layout, swaps, false))
+            continue;
+
+        minimizeCase(this, &KeyboardLayoutOptimizer::verifyCase, layout, swaps);
+
+        printf("MISMATCH in case %d\n", c);
+        printf("  layout: \"%s\"\n", layout);
+        printf("  swaps: ");
+        for (size_t i=0; i<swaps.size(); i++)
+            printf("%s(%d,%d)", (i? ", ": ""), swaps[i].first, swaps[i].second);
+        printf("%s\n", (swaps.empty()? "none": ""));
+        verifyCase(layout, swaps, true);
+
+        if (++failures >= 10) {
+            printf("Too many mismatches, giving up\n");
+            break;
+        }
+    }
+
+    printf("Verified %ld layouts in %d cases: %d mismatches\n", steps, cases, failures);
+    return failures == 0;
+}